@@ -0,0 +1,77 @@
+#include "buffer.hh"
+#include "tools.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+using editor::Buffer;
+
+// Loads a generated file with 1 up to all cores as set by MIV_THREADS.
+// Usage: load_bench [megabytes] [directory]
+
+static bool generate(const std::string &filename, uint64_t size)
+{
+    FILE *out = fopen(filename.c_str(), "w");
+    if (out == nullptr) return false;
+    // Mixed line lengths, tabs and multibyte characters
+    const char *words[] = { "log", "entry\t", "värde", "日本語", "0123456789", "\tindented", "ok" };
+    uint64_t written = 0;
+    std::string line;
+    for (uint64_t i = 0; written < size; ++i) {
+        line = std::to_string(i);
+        for (uint64_t w = 0; w < i % 23; ++w) {
+            line += ' ';
+            line += words[(i + w) % 7];
+        }
+        line += '\n';
+        written += fwrite(line.data(), 1, line.length(), out);
+    }
+    return fclose(out) == 0;
+}
+
+static double load(const std::string &filename, uint32_t &lines)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    Buffer b(filename);
+    // Indexes the rest of the file
+    lines = b.size();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t megabytes = argc > 1 ? strtoull(argv[1], nullptr, 10) : 300;
+    std::string dir = argc > 2 ? argv[2] : "/tmp";
+    std::string filename = dir + "/miv-load-bench." + std::to_string(getpid());
+    if (!generate(filename, megabytes * 1024 * 1024)) {
+        fprintf(stderr, "can not write %s\n", filename.c_str());
+        unlink(filename.c_str());
+        return 1;
+    }
+
+    // An index cached by the first load would skip the scan after it
+    setenv("XDG_CACHE_HOME", "", 1);
+    setenv("HOME", "", 1);
+    unsetenv("MIV_THREADS");
+    uint32_t cores = editor::workerCount();
+
+    uint32_t lines = 0;
+    // Reads the file into the page cache
+    load(filename, lines);
+    printf("%llu MB, %u lines\n", static_cast<unsigned long long>(megabytes), lines);
+    printf("%8s %10s %10s\n", "threads", "seconds", "MB/s");
+    for (uint32_t t = 1; t <= cores; ++t) {
+        setenv("MIV_THREADS", std::to_string(t).c_str(), 1);
+        double best = 0;
+        for (int i = 0; i < 3; ++i) {
+            double s = load(filename, lines);
+            if (i == 0 || s < best) best = s;
+        }
+        printf("%8u %10.3f %10.0f\n", t, best, megabytes / best);
+    }
+    unlink(filename.c_str());
+    return 0;
+}
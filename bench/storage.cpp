@@ -0,0 +1,78 @@
+#include "piecetable.hh"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using editor::PieceTable;
+
+// Inserts and erases lines at random positions of a large file, once in
+// a vector of lines like the buffer used to keep, once in a piece table.
+// Usage: storage_bench [lines] [edits]
+
+template <typename Fn>
+static double measure(Fn fn)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t lines = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    uint32_t edits = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000;
+    if (lines == 0) return 1;
+
+    std::string contents;
+    for (uint32_t i = 0; i < lines; ++i) contents += "line " + std::to_string(i) + " of the benchmark file\n";
+    const std::string line = "inserted line";
+
+    std::vector<uint32_t> at;
+    std::mt19937 random(1);
+    for (uint32_t i = 0; i < edits; ++i) at.push_back(random() % lines);
+
+    std::vector<std::string> vec;
+    double vecLoad = measure([&]() {
+        std::string::size_type pos = 0;
+        while (pos < contents.length()) {
+            std::string::size_type end = contents.find('\n', pos);
+            vec.push_back(contents.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    });
+    double vecInsert = measure([&]() {
+        for (uint32_t y : at) vec.insert(vec.begin() + y, line);
+    });
+    double vecErase = measure([&]() {
+        for (uint32_t y : at) vec.erase(vec.begin() + y);
+    });
+
+    PieceTable table;
+    double tableLoad = measure([&]() {
+        table.load(contents);
+        table.indexAll();
+    });
+    double tableInsert = measure([&]() {
+        for (uint32_t y : at) table.insert(y, line);
+    });
+    size_t pieces = table.pieceCount();
+    double tableErase = measure([&]() {
+        for (uint32_t y : at) table.erase(y);
+    });
+
+    if (vec.size() != table.size()) {
+        fprintf(stderr, "line counts differ: %zu and %u\n", vec.size(), table.size());
+        return 1;
+    }
+
+    printf("%u lines, %u edits\n", lines, edits);
+    printf("%-12s %10s %10s %10s\n", "", "load ms", "insert ms", "erase ms");
+    printf("%-12s %10.1f %10.1f %10.1f\n", "vector", vecLoad, vecInsert, vecErase);
+    printf("%-12s %10.1f %10.1f %10.1f\n", "piece table", tableLoad, tableInsert, tableErase);
+    printf("%zu pieces after inserting\n", pieces);
+    return 0;
+}
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cstdint>
 #include "undo.hh"
+#include "piecetable.hh"
+#include "lineinfo.hh"
+#include "savejob.hh"
+#include "journal.hh"
+#include "filewatcher.hh"
 
 namespace editor {
 
@@ -19,6 +26,51 @@ public:
 
     bool readFile(std::string filename);
     bool writeFile(std::string filename);
+    // Saves a snapshot of the buffer on a worker thread, only one at a time
+    bool startWrite(std::string filename);
+    bool writing() const { return save != nullptr; }
+    bool writeDone() const { return save && save->done(); }
+    std::string writingName() const { return saveName; }
+    uint32_t writeProgress() const;
+    // Waits for the save started last, returns whether it succeeded
+    bool finishWrite();
+    // Size of and time taken by the last finished save
+    uint64_t written() const { return savedBytes; }
+    double writeSeconds() const { return saveSeconds; }
+    void setSyncOnSave(bool sync) { syncOnSave = sync; }
+    // Whether a journal of unsaved edits was left behind for the file
+    bool hasSwap() const { return swapFound; }
+    // Replays that journal, records is set to the number of edits applied
+    bool recover(uint64_t &records);
+    // Writes out journal records when due, or all of them when idle
+    static void syncJournals(bool idle);
+    static bool journalPending();
+    // Closes the journal of every open buffer, removing the swap files
+    // unless they are kept for recovery
+    static void closeJournals(bool remove);
+
+    // Watches the file and adds whatever gets appended to it, keeping at
+    // most limit lines when limit is not 0. Edits are not journaled.
+    bool follow(uint32_t limit = 0);
+    void unfollow() { followed = false; }
+    bool following() const { return followed; }
+    // Reads data appended since the last call, returns whether any was.
+    // Stops following when the file was replaced under unsaved edits.
+    bool readAppended();
+
+    // Whether the file was touched since the last check, cheap enough
+    // to call while waiting for input
+    bool fileEventsPending();
+    // Takes in the events of every buffer so their watches go quiet
+    static void pollFileEvents();
+    // Whether the file is no longer what was last read or written,
+    // true once per change
+    bool changedOnDisk();
+    // Patches in the lines that differ from the file, keeping the
+    // cursor on the same line. changed is set to the lines replaced.
+    bool reload(uint32_t &changed);
+    // Edits made since the file was last read or written
+    bool modified() const { return changes != savedChanges; }
     bool hasFilename() const {
         return !fileName.empty();
     }
@@ -26,19 +78,29 @@ public:
         return fileName;
     }
 
-    void addLine(std::string line);
-    void insertLine(std::string line);
-    void updateLine(std::string line);
+    void addLine(std::string_view line);
+    void insertLine(std::string_view line);
+    // Inserts cnt copies of lines below the cursor and moves onto the last one
+    void insertLines(const std::vector<std::string> &lines, uint32_t cnt = 1);
     void deleteLine(uint32_t cnt = 1);
-    void append(std::string line);
+    void append(std::string_view line);
     void append(char line);
+    // Inserts text at the cursor, newlines included, as one edit
+    void insertText(std::string_view text);
+    // Ends in place editing of the current line
+    void commitLine();
+    // Keeps the cursor on the text, past the end only when expand is set
+    void sanitizePos(bool expand = false);
 
-    const std::string line() const;
+    // Views borrow from the buffer and are valid until the next edit
+    std::string_view line() const;
     uint32_t lineLength() const;
     uint32_t tabs() const;
     uint32_t tabExtra() const;
-    const std::vector<std::string> copyLines(uint32_t cnt = 1) const;
-    const std::vector<std::string> copyLinesUp(uint32_t cnt = 1) const;
+    // Screen column of the cursor, counted no further than limit
+    uint32_t screenX(uint32_t limit) const;
+    std::vector<std::string> copyLines(uint32_t cnt = 1) const;
+    std::vector<std::string> copyLinesUp(uint32_t cnt = 1) const;
 
     void cursorLeft(uint32_t cnt = 1);
     void cursorRight(uint32_t cnt = 1);
@@ -55,13 +117,20 @@ public:
     void deleteChars(uint32_t cnt = 1);
 
     void relocateRow(uint32_t width, uint32_t height);
-    const std::vector<std::string> viewport(uint32_t width, uint32_t height) const;
+    // Appends the first width columns of line y as shown, tabs expanded,
+    // wide characters taking two
+    void renderLine(uint32_t y, std::string &out, uint32_t width) const;
 
     uint32_t x() const { return posX; }
     uint32_t y() const { return posY; }
     uint32_t size() const { return data.size(); }
+    bool sizeKnown() const { return data.complete(); }
+    bool loading() const { return data.loading(); }
+    uint32_t loadPercent() const { return data.loadPercent(); }
+    bool validUtf8() const { return data.validUtf8(); }
     uint32_t y(uint32_t height) const { return posY - row; }
-    bool atEnd() const { return posY == data.size() - 1; }
+    uint32_t topRow() const { return row; }
+    bool atEnd() const { return !data.has(posY + 1); }
     void gotoY(uint32_t y = 0);
 
     static uint32_t cnt() {
@@ -82,27 +151,82 @@ public:
     static Buffer* newBuffer() {
         return new Buffer();
     }
-    std::string tabsToSpace(const std::string &d) const;
+    std::string tabsToSpace(std::string_view d) const;
+    std::string tabsExpanded(std::string_view d) const;
 
     void undoAdd(UndoableAction act);
     void undoRecordPrePos();
     void undoRecordPostPos();
     void undoApplyLine();
+    void undoLine(std::string_view l);
 
     void undoDump() const { undos.dump(); }
 
 private:
-    std::vector<std::string> data;
+    PieceTable data;
     uint32_t posX;
     uint32_t posY;
     uint32_t row;
     uint32_t tabSize;
     bool tabsToSpaces;
-
-    void sanitizePos(bool expand = false);
+    bool syncOnSave;
+    bool swapFound;
+    uint64_t savedBytes;
+    double saveSeconds;
+    std::unique_ptr<SaveJob> save;
+    std::string saveName;
+    Journal journal;
+    uint64_t journalMark;
+    FileWatcher watcher;
+    uint32_t followLimit;
+    uint64_t followPos;
+    // Last line of the file has no newline yet
+    bool followOpen;
+    bool followed;
+    uint32_t fileEvents;
+
+    // Identity of the file when it was last read or written
+    struct DiskState {
+        uint64_t size;
+        uint64_t inode;
+        int64_t sec;
+        int64_t nsec;
+    };
+    DiskState disk;
+    uint64_t changes;
+    uint64_t savedChanges;
+    uint64_t saveChanges;
+
+    // Metadata of the line at infoY, kept up to date by edits in insert mode
+    mutable LineInfo info;
+    mutable uint32_t infoY;
+
+    // Where the previous edit left the gap of the line being edited
+    struct EditPos {
+        uint64_t revision;
+        uint32_t x;
+        uint32_t y;
+        uint32_t length;
+        size_t offset;
+    };
+    EditPos editPos;
+
+    GapBuffer &editLine();
+    void editDone(uint32_t gapX, bool expand = false);
+    const LineInfo &lineInfo() const;
+    void invalidateLineInfo() { infoY = UINT32_MAX; }
+    void expandTabs();
+    void detectLineEnding();
+    void startJournal();
+    void watchFile();
+    void takeFileEvents();
+    DiskState diskState() const;
+    void appendText(std::string_view text);
+    void trimToLimit();
+    std::string_view endingFor(std::string_view line) const;
+    void snapshot(SaveJob &job) const;
 
     std::string spaces(uint32_t cnt) const;
-    std::string handleSpecial(std::string line) const;
 
     std::string lineEnding;
     std::string fileName;
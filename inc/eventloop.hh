@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <poll.h>
+
+namespace editor {
+
+// Sleeps in poll until the terminal has input, a watched descriptor is
+// readable, the window was resized, a worker thread called wake() or
+// the timeout passed
+class EventLoop
+{
+public:
+    enum Event : uint32_t {
+        Input = 1,
+        Resize = 2,
+        Descriptor = 4,
+        Wakeup = 8,
+        Timeout = 16
+    };
+
+    static EventLoop *get();
+
+    void watch(int fd);
+    void unwatch(int fd);
+
+    // Safe to call from other threads and signal handlers
+    static void wake();
+
+    // Events that happened, waits forever when timeoutMs is negative
+    uint32_t wait(int timeoutMs);
+
+private:
+    EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // Terminal input and the wake pipe first, watched descriptors after
+    std::vector<struct pollfd> fds;
+};
+
+}
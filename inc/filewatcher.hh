@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+namespace editor {
+
+// Watches one file with inotify without blocking, reporting when it was
+// written to or when the name now points to another file
+class FileWatcher
+{
+public:
+    enum Event : uint32_t {
+        Modified = 1,
+        Replaced = 2
+    };
+
+    FileWatcher();
+    ~FileWatcher();
+
+    bool watch(const std::string &filename);
+    void close();
+    bool isOpen() const { return fd >= 0; }
+    int descriptor() const { return fd; }
+
+    // Events seen since the last call, 0 when there were none
+    uint32_t poll();
+
+private:
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    int fd;
+    int wd;
+};
+
+}
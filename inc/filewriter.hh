@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+namespace editor {
+
+// Writes a file through a temporary next to it that replaces the file
+// only once everything is written, so a failed save leaves it untouched.
+// In place mode instead overwrites parts of the existing file.
+class FileWriter
+{
+public:
+    FileWriter();
+    ~FileWriter();
+
+    bool open(const std::string &filename);
+    // Fails unless the file is still the one described by expected,
+    // with the same size and modification time
+    bool openInPlace(const std::string &filename, const struct stat &expected);
+    // Data is queued, not copied, and has to stay valid until flush()
+    bool write(std::string_view data);
+    // Leaves cnt bytes of the existing file as they are
+    bool skip(uint64_t cnt);
+    // Same as write(data), but lets the kernel copy it from the file at
+    // offset of fd when possible. Data must be that part of the file.
+    bool copy(int fd, uint64_t offset, std::string_view data);
+    bool flush();
+    // Keeps the permissions of the file being replaced
+    bool commit(bool sync);
+    void abort();
+
+    uint64_t size() const { return position + queued; }
+    uint64_t written() const { return bytes; }
+
+private:
+    FileWriter(const FileWriter &) = delete;
+    FileWriter &operator=(const FileWriter &) = delete;
+
+    std::string target;
+    std::string tempName;
+    int fd;
+    bool inPlace;
+    bool canCopy;
+    std::vector<iovec> queue;
+    uint64_t queued;
+    // File offset the queue starts at
+    uint64_t position;
+    uint64_t bytes;
+};
+
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+namespace editor {
+
+// Text with a movable hole at the edit position, so inserting and
+// erasing next to it does not move the rest of the text
+class GapBuffer
+{
+public:
+    GapBuffer();
+
+    void assign(std::string_view s);
+    void clear() { assign(""); }
+
+    size_t length() const { return buf.length() - (gapEnd - gapStart); }
+    size_t gap() const { return gapStart; }
+    void moveTo(size_t pos) const;
+
+    void insert(std::string_view s);
+    void insert(size_t cnt, char c);
+    void eraseBefore(size_t cnt);
+    void eraseAfter(size_t cnt);
+
+    std::string_view before() const { return std::string_view(buf.data(), gapStart); }
+    std::string_view after() const { return std::string_view(buf.data() + gapEnd, buf.length() - gapEnd); }
+    // Contiguous contents, closes the gap by moving it to the end
+    std::string_view view() const;
+
+private:
+    void reserve(size_t cnt);
+
+    // Moving the gap does not change the contents
+    mutable std::string buf;
+    mutable size_t gapStart;
+    mutable size_t gapEnd;
+};
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <sys/stat.h>
+
+namespace editor {
+
+// Line starts of a mapped file kept under the user's cache directory,
+// keyed by device and inode, so the file is not scanned again when it
+// is reopened unchanged. Indexes of files that changed or went away are
+// dropped, as are ones unused for long or over the size limit.
+class IndexCache
+{
+public:
+    IndexCache();
+    ~IndexCache();
+
+    // Maps the index stored for the open file fd named filename, fails
+    // when there is none or the file changed since it was stored
+    bool open(int fd, const std::string &filename);
+    void close();
+    // Stores the index of the file last passed to open() as it was then.
+    // Written on a background thread, which also prunes the directory.
+    bool store(const std::vector<uint64_t> &starts, bool valid) const;
+
+    // Line starts including the end sentinel, as in PieceTable
+    const uint64_t *starts() const { return lineStarts; }
+    uint64_t count() const { return startCount; }
+    bool validUtf8() const { return valid; }
+
+private:
+    IndexCache(const IndexCache &) = delete;
+    IndexCache &operator=(const IndexCache &) = delete;
+
+    static std::string directory();
+    static bool write(const std::string &dir, const std::string &name, const std::string &path,
+        const std::vector<uint64_t> &starts, bool valid, const struct stat &file);
+    static void prune(const std::string &dir, const std::string &keep);
+
+    std::string dir;
+    std::string name;
+    // Absolute name of the indexed file, to tell when it changed
+    std::string path;
+    struct stat file;
+    void *base;
+    size_t length;
+    const uint64_t *lineStarts;
+    uint64_t startCount;
+    bool valid;
+    mutable std::thread writer;
+};
+
+}
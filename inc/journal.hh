@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "piecetable.hh"
+
+namespace editor {
+
+// Append-only log of the edits made to a buffer since its file was last
+// read or written, kept next to the file so they can be replayed after
+// a crash
+class Journal
+{
+public:
+    Journal();
+    ~Journal();
+
+    static std::string swapName(const std::string &filename);
+    static bool exists(const std::string &filename);
+
+    // Starts a new journal on top of the file as it is on disk now
+    bool create(const std::string &filename);
+    // Continues the journal left behind for filename
+    bool resume(const std::string &filename);
+    // Rebases on the file just saved as filename, keeping the records
+    // written after mark() was taken
+    bool restart(const std::string &filename, uint64_t mark);
+    void close(bool remove);
+    bool isOpen() const { return fd >= 0; }
+
+    void insertLines(uint32_t y, const std::vector<std::string_view> &lines);
+    void insertLine(uint32_t y, std::string_view line);
+    void erase(uint32_t y, uint32_t cnt);
+    void update(uint32_t y, std::string_view line);
+    void insertText(uint32_t y, uint64_t offset, std::string_view text);
+    void eraseText(uint32_t y, uint64_t offset, uint64_t cnt);
+
+    // Records are written in batches, flush() writes whatever is pending
+    bool pending() const { return !buffer.empty(); }
+    bool due() const;
+    bool flush();
+    uint64_t mark();
+
+    // Applies the journal of filename to a table holding the file, fails
+    // if the file changed since the journal was started
+    static bool replay(const std::string &filename, PieceTable &table, uint64_t &records);
+
+private:
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    void begin(uint8_t op, uint32_t y);
+    void put(uint64_t v);
+    void put(std::string_view s);
+
+    std::string path;
+    int fd;
+    std::string buffer;
+    uint64_t size;
+    std::chrono::steady_clock::time_point lastFlush;
+};
+
+}
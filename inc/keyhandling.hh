@@ -5,6 +5,8 @@
 
 namespace editor {
 
+class Buffer;
+
 enum class Mode {
     NormalMode,
     InsertMode,
@@ -43,6 +45,7 @@ private:
     void processNormalMode();
     void resetNormalMode();
     void processInsertMode();
+    void pasteText(const std::string &text);
     void executeCommand();
 
     void handleCopy();
@@ -51,7 +54,10 @@ private:
     void handleCommandEdit();
 
     uint32_t parseMultiplier(bool forceOne = true);
-    void saveFile(std::string fname) const;
+    bool saveFile(std::string fname);
+    void checkWrites(bool wait);
+    void checkFile();
+    void reloadFile();
 
     Mode mode;
     char lastChar;
@@ -64,6 +70,9 @@ private:
 
     std::vector<std::string> copyBuffer;
     std::string copyBufferChars;
+
+    // Buffers with a save running in the background
+    std::vector<Buffer*> writing;
 };
 
 }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <functional>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace editor {
+
+// Lines oldCount lines from oldStart were replaced by newCount lines
+// from newStart
+struct DiffHunk {
+    uint32_t oldStart;
+    uint32_t oldCount;
+    uint32_t newStart;
+    uint32_t newCount;
+};
+
+typedef std::function<std::string_view(uint32_t)> LineSource;
+
+// Line based diff, lines between the common prefix and suffix are
+// compared by hash first and by text when the hashes match. Past maxEdits changed lines that whole region is
+// given as a single hunk.
+std::vector<DiffHunk> diffLines(uint32_t oldCount, const LineSource &oldLine,
+    uint32_t newCount, const LineSource &newLine, uint32_t maxEdits = 1024);
+
+// Where line y ends up after the hunks are applied
+uint32_t mapLine(const std::vector<DiffHunk> &hunks, uint32_t y);
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+namespace editor {
+
+// Finds line starts of a file on a background thread, so the start of
+// a file can be shown while the rest is still being read
+class LineIndexer
+{
+public:
+    LineIndexer();
+    ~LineIndexer();
+
+    void start(const char *data, uint64_t from, uint64_t size);
+    void stop();
+    bool running() const { return worker.joinable(); }
+
+    // Appends the line starts found so far to starts, first waiting until
+    // there are at least want of them. Returns true once the whole file
+    // has been handed out.
+    bool take(std::vector<uint64_t> &starts, uint64_t want, bool &valid);
+    uint64_t scanned() const { return pos; }
+
+private:
+    LineIndexer(const LineIndexer &) = delete;
+    LineIndexer &operator=(const LineIndexer &) = delete;
+
+    void run();
+
+    const char *base;
+    uint64_t end;
+
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<uint64_t> found;
+    std::atomic<uint64_t> pos;
+    bool valid;
+    bool done;
+    bool stopping;
+};
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "tools.hh"
+
+namespace editor {
+
+class LineInfo
+{
+public:
+    LineInfo();
+
+    void update(std::string_view first, std::string_view second, uint32_t tabSize);
+    // Follow an edit of the line, see Utf8Index
+    void insert(uint32_t pos, std::string_view::size_type offset, std::string_view text);
+    void erase(uint32_t pos, std::string_view::size_type offset, uint32_t cnt, std::string_view::size_type bytes);
+
+    uint32_t length() const { return idx.length(); }
+    bool ascii() const { return idx.ascii(); }
+    uint32_t width() const { return cols; }
+    const Utf8Index &index() const { return idx; }
+
+    uint32_t tabsBefore(uint32_t pos) const;
+    uint32_t tabExtraBefore(uint32_t pos) const;
+
+private:
+    void measureTabs(uint32_t from);
+
+    Utf8Index idx;
+    uint32_t cols;
+    uint32_t tabSize;
+
+    // Codepoint position of each tab and the padding added up to and including it
+    std::vector<uint32_t> tabPos;
+    std::vector<uint32_t> tabExtra;
+};
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace editor {
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string &filename);
+    void close();
+
+    bool isOpen() const { return fd >= 0; }
+    bool sameFile(const std::string &filename) const;
+
+    int descriptor() const { return fd; }
+    const char *data() const { return base; }
+    uint64_t size() const { return length; }
+    // The file as it was when mapped
+    const struct stat &status() const { return info; }
+    // Size of the file now, pages of the mapping past it fault when read
+    uint64_t fileSize() const;
+
+    // Runs fn, which reads from a mapping, and returns false instead of
+    // faulting when it reads past the end of a file that shrank
+    static bool guard(const std::function<void()> &fn);
+
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    int fd;
+    const char *base;
+    uint64_t length;
+    struct stat info;
+};
+
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include "mappedfile.hh"
+#include "gapbuffer.hh"
+#include "lineindexer.hh"
+#include "indexcache.hh"
+
+namespace editor {
+
+class PieceTable
+{
+public:
+    PieceTable();
+
+    void clear();
+    void load(std::string contents);
+    bool map(const std::string &filename);
+    bool isMapped(const std::string &filename) const {
+        return mapped && mapped->sameFile(filename);
+    }
+    // Replaces a mapped original whose file got shorter with a copy of
+    // what is left. Lines past the new end are kept, but empty. Returns
+    // true when the mapping was dropped.
+    bool unmapShrunk();
+    // Open descriptor of the mapped original, -1 when it was loaded
+    int originalFd() const { return mapped ? mapped->descriptor() : -1; }
+    const struct stat *originalStatus() const { return mapped ? &mapped->status() : nullptr; }
+    // Keeps the original alive, for example while it is being saved
+    std::shared_ptr<const void> originalStorage() const;
+    const char *originalBase() const { return originalData; }
+    uint64_t originalLength() const { return originalSize; }
+    // Offset in the original of a view handed out by forEachBlock()
+    uint64_t originalOffset(std::string_view whole) const { return whole.data() - originalData; }
+
+    // Line index is built on demand, size() forces the whole file to be indexed
+    uint32_t size() const { return indexAll(), lines; }
+    bool has(uint32_t y) const { return indexTo(y), y < lines; }
+    bool empty() const { return !has(0); }
+    bool complete() const { return indexed; }
+    // Share of a mapped file indexed in the background so far
+    uint32_t loadPercent() const;
+    bool loading() const { return loader.running(); }
+    void indexAll() const { indexTo(UINT32_MAX); }
+    // Only covers the part of the original indexed so far
+    bool validUtf8() const { return utf8Valid; }
+    // Borrowed view, valid until the next change to the table
+    std::string_view line(uint32_t y) const;
+    // Same text in two parts, the line under edit is split at its gap
+    // instead of having the gap closed
+    void line(uint32_t y, std::string_view &first, std::string_view &second) const;
+
+    void insert(uint32_t y, std::string_view line);
+    void insert(uint32_t y, const std::vector<std::string_view> &lines);
+    // Line may be a view of the line it replaces
+    void update(uint32_t y, std::string_view line);
+    void erase(uint32_t y, uint32_t cnt = 1);
+    void push_back(std::string_view line) { insert(size(), line); }
+
+    // Walks the whole text in order without indexing the rest of the
+    // original. A whole block is a run of lines from the original with
+    // their newlines, anything else is a single line without one. Stops
+    // early when fn returns false.
+    bool forEachBlock(const std::function<bool(std::string_view text, bool whole)> &fn) const;
+
+    // Moves line y into a buffer that can be changed in place, the
+    // reference is valid until the next call to edit() or clear()
+    GapBuffer &edit(uint32_t y);
+    // Buffer handed out by the last edit()
+    GapBuffer &current() { return editing; }
+    // Moves the line being edited back to its own line storage
+    void commit();
+
+    // Changes whenever lines move or the line being edited changes,
+    // but not when the edited line itself is changed in place
+    uint64_t revision() const { return rev; }
+
+    size_t pieceCount() const { return nodes.size() - freeNodes.size(); }
+
+private:
+    enum class Source : uint8_t {
+        Original,
+        Added,
+        Editing
+    };
+
+    struct Piece {
+        Source source;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // Pieces are kept in a treap ordered by position, each node knows
+    // the number of lines in its subtree
+    struct Node {
+        Piece piece;
+        uint32_t lines;
+        uint32_t priority;
+        uint32_t left;
+        uint32_t right;
+    };
+    static const uint32_t nil = UINT32_MAX;
+
+    void indexTo(uint32_t y) const;
+    void indexRest() const;
+    void takeLoaded(uint64_t want) const;
+    void addIndexed(uint32_t first) const;
+    std::string_view text(const Piece &piece, uint32_t offset) const;
+    uint64_t lineStart(uint32_t l) const {
+        return cache.starts() ? cache.starts()[l] : originalStarts[l];
+    }
+    uint32_t addLine(std::string_view line);
+    void releaseLines(const Piece &piece);
+
+    uint32_t newNode(const Piece &piece) const;
+    void release(uint32_t n);
+    uint32_t total(uint32_t n) const { return n == nil ? 0 : nodes[n].lines; }
+    void pull(uint32_t n) const;
+    uint32_t merge(uint32_t a, uint32_t b) const;
+    void splitAt(uint32_t n, uint32_t y, uint32_t &a, uint32_t &b) const;
+    uint32_t append(uint32_t n, const Piece &piece) const;
+    uint32_t locate(uint32_t y, uint32_t &offset) const;
+    bool visit(uint32_t n, const std::function<bool(std::string_view, bool)> &fn) const;
+
+    // Original file contents, never modified after load. Either owned
+    // or a read-only mapping of the file, shared with pending saves.
+    std::shared_ptr<const std::string> original;
+    std::shared_ptr<MappedFile> mapped;
+    const char *originalData;
+    uint64_t originalSize;
+
+    // Edited and new lines each get their own string, slots of
+    // erased lines are freed and reused
+    std::vector<std::string> added;
+    std::vector<uint32_t> freeSlots;
+    // The one line being edited in place, referenced by at most one piece
+    GapBuffer editing;
+
+    // Start offset of each line in the original, plus one end sentinel.
+    // A mapped file indexed before uses the stored index instead.
+    mutable std::vector<uint64_t> originalStarts;
+    IndexCache cache;
+
+    // Not yet indexed part of the original always follows the last piece
+    mutable std::vector<Node> nodes;
+    mutable std::vector<uint32_t> freeNodes;
+    mutable uint32_t root;
+    mutable uint32_t seed;
+    uint32_t editNode;
+    mutable uint32_t lines;
+    mutable uint64_t scanPos;
+    mutable bool indexed;
+    mutable bool utf8Valid;
+    mutable LineIndexer loader;
+    uint64_t rev;
+};
+
+}
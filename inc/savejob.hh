@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <sys/stat.h>
+
+namespace editor {
+
+// Text of a buffer frozen for saving. Untouched parts point into the
+// original, everything else is copied, so the buffer can be edited
+// while a worker thread writes the file.
+class SaveJob
+{
+public:
+    SaveJob();
+    ~SaveJob();
+
+    // Status is the mapped file as it was mapped, when there is one
+    void setOriginal(std::shared_ptr<const void> storage, const char *data, uint64_t size, int fd, const struct stat *status);
+    void addOriginal(std::string_view text);
+    void addCopy(std::string_view text);
+
+    // True when the original is still in place, so only the copied
+    // parts need to be written into it
+    bool sameLayout() const;
+
+    // A file that changed on disk since it was mapped is replaced instead
+    // of written in place
+    bool run(const std::string &filename, bool inPlace, bool sync);
+    void start(const std::string &filename, bool inPlace, bool sync);
+    bool done() const { return finished; }
+    // Waits for start() to finish, returns whether the file was written
+    bool wait();
+
+    uint64_t size() const { return total; }
+    uint64_t progress() const { return written; }
+    double seconds() const { return elapsed; }
+
+private:
+    SaveJob(const SaveJob &) = delete;
+    SaveJob &operator=(const SaveJob &) = delete;
+
+    struct Block {
+        bool original;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    std::vector<Block> blocks;
+    std::string copied;
+    uint64_t total;
+
+    std::shared_ptr<const void> storage;
+    const char *originalData;
+    uint64_t originalSize;
+    int originalFd;
+    struct stat originalStatus;
+
+    std::thread worker;
+    std::atomic<uint64_t> written;
+    std::atomic<bool> finished;
+    bool result;
+    double elapsed;
+};
+
+}
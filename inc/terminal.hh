@@ -1,11 +1,17 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
+#include <cstdint>
 #include <termios.h>
+#include <sys/types.h>
 
 namespace editor {
 
+class Buffer;
+
 class Terminal
 {
 
@@ -40,12 +46,34 @@ public:
     static std::string cursorPos(int x, int y);
     void flush();
 
+    // Takes in a new window size, the next refresh redraws everything
+    void resize();
+
     int getWidth() const { return width; }
     int getHeight() const;
 
+    // Input is read in chunks and handed out a key at a time
+    bool takeInput(char &c);
+    ssize_t readInput();
+    // Whether keys are waiting, without blocking
+    bool inputPending();
+    // Whether the terminal hung up or input reached its end
+    bool closed() const { return inputClosed; }
+    // Takes a bracketed paste following the ESC just read, if there is one
+    bool takePaste(std::string &text);
+
+    // Bytes written to the terminal and screen refreshes so far
+    uint64_t bytesWritten() const { return bytesOut; }
+    uint64_t refreshCount() const { return refreshes; }
+
 private:
     Terminal();
-    std::string renderLines(const std::vector<std::string> &lines) const;
+
+    // Each cell holds the UTF-8 bytes of one character and its combining
+    // marks, first byte lowest. When they need more than four bytes the top
+    // byte is 0xFF and the rest indexes clusters. The right half of a wide
+    // character is 0.
+    typedef std::vector<uint32_t> Row;
 
     void setInputFlags();
     void setOutputFlags();
@@ -53,11 +81,19 @@ private:
     void setTimeout();
     void getWindowSize();
     void flushBuffer();
-    void flushData();
-    void flushTemp();
-    void flushStatus();
-    void flushInfo();
-    void relocateCursor();
+    void output(const std::string &s);
+    bool detectSyncOutput();
+    bool waitInput(int timeoutMs);
+    void putText(Row &cells, int col, std::string_view text);
+    uint32_t packCell(std::string_view bytes);
+    void appendCell(std::string &out, uint32_t cell) const;
+    std::string infoText() const;
+    std::string_view commandText() const;
+    // Frame is what should be on screen, screen what is there now
+    void composeFrame();
+    void drawFrame(std::string &out);
+    void moveCursor(std::string &out, int x, int y);
+    void scrollText(std::string &out, int delta);
 
     struct termios raw;
 
@@ -68,6 +104,25 @@ private:
     std::string temp;
     std::string status;
     uint32_t statusTime;
+    std::string bottom;
+
+    std::vector<Row> screen;
+    std::vector<Row> frame;
+    std::vector<std::string> clusters;
+    std::unordered_map<std::string, uint32_t> clusterIds;
+    int cursorX;
+    int cursorY;
+    // Buffer and top row the screen shows, to scroll instead of repaint
+    const Buffer *screenBuffer;
+    int64_t screenRow;
+    uint64_t bytesOut;
+    uint64_t refreshes;
+    // Frames are wrapped in DEC mode 2026 so they show up all at once
+    bool syncOutput;
+    std::string out;
+    std::string input;
+    std::string::size_type inputPos;
+    bool inputClosed;
 };
 
 }
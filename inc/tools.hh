@@ -1,18 +1,77 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <vector>
 #include <algorithm>
+#include <functional>
+#include <cstdint>
 
 namespace editor {
 
-std::string substrSafe(std::string s, std::string::size_type p, std::string::size_type cnt = std::string::npos);
-bool utf8_valid(std::string s);
-char utf8_at(std::string s, uint32_t p);
-std::string utf8_at_str(std::string s, uint32_t p);
-uint32_t utf8_length(std::string s);
+// Sparse codepoint to byte offset index of one string
+class Utf8Index
+{
+public:
+    Utf8Index();
+    explicit Utf8Index(std::string_view s);
+
+    // A line may be given in two parts, as around the gap of the line under edit
+    void build(std::string_view first, std::string_view second = "");
+    std::string_view::size_type offset(std::string_view s, uint32_t p) const;
+    std::string_view::size_type offset(std::string_view first, std::string_view second, uint32_t p) const;
+
+    // Keep the index in step with text inserted or erased at codepoint
+    // pos, byte offset, without looking at the rest of the line
+    void insert(uint32_t pos, std::string_view::size_type offset, std::string_view text);
+    void erase(uint32_t pos, std::string_view::size_type offset, uint32_t cnt, std::string_view::size_type bytes);
+
+    uint32_t length() const { return len; }
+    bool ascii() const { return isAscii; }
+
+private:
+    struct Mark {
+        uint32_t pos;
+        std::string_view::size_type offset;
+    };
+    std::vector<Mark>::iterator markAt(uint32_t pos);
+
+    uint32_t len;
+    bool isAscii;
+    // Codepoint and byte offset of about every utf8IndexStep:th codepoint,
+    // starting at 0 and never more than twice that apart. Empty for ASCII.
+    std::vector<Mark> marks;
+    // Marks being added by insert(), kept to reuse its storage
+    std::vector<Mark> added;
+};
+
+// Returned views borrow from s
+std::string_view substrSafe(std::string_view s, std::string_view::size_type p, std::string_view::size_type cnt = std::string_view::npos);
+std::string_view substrSafe(std::string_view s, const Utf8Index &idx, std::string_view::size_type p, std::string_view::size_type cnt = std::string_view::npos);
+bool utf8_valid(std::string_view s);
+bool utf8_valid(const char *begin, const char *end);
+char utf8_at(std::string_view s, uint32_t p);
+char utf8_at(std::string_view s, const Utf8Index &idx, uint32_t p);
+std::string_view utf8_at_str(std::string_view s, uint32_t p);
+std::string_view utf8_at_str(std::string_view s, const Utf8Index &idx, uint32_t p);
+uint32_t utf8_length(std::string_view s);
+uint32_t utf8_length(const char *begin, const char *end);
+// Codepoint at p, moving p past it, or UINT32_MAX and one byte on for invalid UTF-8
+uint32_t utf8_decode(const char *&p, const char *end);
+// Terminal columns of a codepoint: 0 for combining marks, 2 for wide
+// characters and -1 for ones that can not be shown
+int charWidth(uint32_t c);
 
 void log(std::string prefix, std::string s);
 
+// Threads to split work between, MIV_THREADS overrides the core count
+uint32_t workerCount();
+void parallel(uint32_t jobs, std::function<void(uint32_t)> fn);
+
+// Heap allocations so far, only counted when built with count_allocations
+bool countingAllocations();
+uint64_t allocationCount();
+
 // trim from start (in place)
 static inline void ltrim(std::string &s) {
     s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](int ch) {
@@ -1,14 +1,56 @@
 #include "buffer.hh"
 #include "tools.hh"
+#include "linediff.hh"
 #include <fstream>
-#include <utf8.h>
 #include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 using editor::Buffer;
 
 std::vector<Buffer*> Buffer::buffers;
 uint32_t Buffer::index = 0;
 static const std::string delimiters = " ,.:;\\/-\t";
+// Files from this size on are mapped and indexed lazily instead of read
+static const off_t largeFileSize = 64 * 1024 * 1024;
+
+static const char *nextChar(const char *p, const char *end)
+{
+    ++p;
+    while (p < end && (*p & 0xC0) == 0x80) ++p;
+    return p;
+}
+
+static const char *prevChar(const char *begin, const char *p)
+{
+    --p;
+    while (p > begin && (*p & 0xC0) == 0x80) --p;
+    return p;
+}
+
+static const char *retreatChars(const char *begin, const char *p, uint32_t cnt)
+{
+    while (cnt-- > 0 && p > begin) p = prevChar(begin, p);
+    return p;
+}
+
+static const char *advanceChars(const char *p, const char *end, uint32_t cnt)
+{
+    while (cnt-- > 0 && p < end) p = nextChar(p, end);
+    return p;
+}
+
+// Columns taken by codepoint c when shown at column col
+static uint32_t columns(uint32_t c, uint32_t col, uint32_t tabSize)
+{
+    if (c == '\t') return tabSize - col % tabSize;
+    int w = c == UINT32_MAX ? -1 : editor::charWidth(c);
+    // Shown as '?', or on a space when there is nothing to combine with
+    if (w < 0 || (w == 0 && col == 0)) return 1;
+    return w;
+}
 
 Buffer::Buffer() :
     posX(0),
@@ -16,6 +58,22 @@ Buffer::Buffer() :
     row(0),
     tabSize(8),
     tabsToSpaces(false),
+    syncOnSave(true),
+    swapFound(false),
+    savedBytes(0),
+    saveSeconds(0),
+    journalMark(0),
+    followLimit(0),
+    followPos(0),
+    followOpen(false),
+    followed(false),
+    fileEvents(0),
+    disk{0, 0, 0, 0},
+    changes(0),
+    savedChanges(0),
+    saveChanges(0),
+    infoY(UINT32_MAX),
+    editPos{UINT64_MAX, 0, 0, 0, 0},
     lineEnding("\n")
 {
     buffers.push_back(this);
@@ -29,6 +87,7 @@ Buffer::Buffer(std::string filename) :
 
 Buffer::~Buffer()
 {
+    journal.close(true);
     removeBuffer(this);
 }
 
@@ -61,99 +120,522 @@ bool Buffer::setCurrent(Buffer *buf)
     return false;
 }
 
-bool Buffer::readFile(std::string filename)
+// Maps large files and reads the rest, leaves table empty on failure
+static bool readTable(const std::string &filename, editor::PieceTable &table)
 {
-    data.erase(data.begin(), data.end());
-    fileName = filename;
-    std::ifstream fd(filename);
+    table.clear();
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= largeFileSize) {
+        if (table.map(filename)) return true;
+    }
+
+    std::ifstream fd(filename, std::ifstream::binary);
     if (!fd.is_open()) return false;
 
-    std::string tmp;
-    while (std::getline(fd, tmp)) {
-        data.push_back(tabsToSpace(tmp));
+    std::string contents;
+    fd.seekg(0, std::ifstream::end);
+    std::streamoff len = fd.tellg();
+    fd.seekg(0, std::ifstream::beg);
+    if (len > 0) {
+        contents.resize(len);
+        fd.read(&contents[0], len);
+        contents.resize(fd.gcount());
     }
     fd.close();
+    table.load(contents);
+    table.indexAll();
     return true;
 }
 
+bool Buffer::readFile(std::string filename)
+{
+    invalidateLineInfo();
+    journal.close(true);
+    fileName = filename;
+    followed = false;
+
+    bool ok = readTable(filename, data);
+    if (ok) {
+        detectLineEnding();
+        if (tabsToSpaces && !data.isMapped(filename)) expandTabs();
+    }
+    startJournal();
+    watchFile();
+    savedChanges = changes;
+    return ok;
+}
+
+Buffer::DiskState Buffer::diskState() const
+{
+    DiskState res{0, 0, 0, 0};
+    struct stat st;
+    if (fileName.empty() || stat(fileName.c_str(), &st) != 0) return res;
+    res.size = st.st_size;
+    res.inode = st.st_ino;
+    res.sec = st.st_mtim.tv_sec;
+    res.nsec = st.st_mtim.tv_nsec;
+    return res;
+}
+
+void Buffer::watchFile()
+{
+    disk = diskState();
+    fileEvents = 0;
+    if (fileName.empty() || !watcher.watch(fileName)) watcher.close();
+}
+
+bool Buffer::fileEventsPending()
+{
+    takeFileEvents();
+    return fileEvents != 0;
+}
+
+void Buffer::takeFileEvents()
+{
+    uint32_t events = watcher.poll();
+    if (events == 0) return;
+    fileEvents |= events;
+    // Pages of a mapped file past its new end fault when read, so the
+    // mapping goes before anything is drawn from it again
+    if (data.unmapShrunk()) {
+        invalidateLineInfo();
+        sanitizePos();
+    }
+}
+
+bool Buffer::changedOnDisk()
+{
+    // Our own saves are taken in once they are done
+    if (!fileEventsPending() || save) return false;
+    uint32_t events = fileEvents;
+    fileEvents = 0;
+
+    DiskState now = diskState();
+    if (now.inode != disk.inode || (events & FileWatcher::Replaced)) watcher.watch(fileName);
+    if (now.size == disk.size && now.inode == disk.inode && now.sec == disk.sec && now.nsec == disk.nsec) return false;
+    // Missing files are left alone, they are often about to be replaced
+    if (now.inode == 0) return false;
+    disk = now;
+    return true;
+}
+
+bool Buffer::reload(uint32_t &changed)
+{
+    changed = 0;
+    if (fileName.empty()) return false;
+
+    // A mapping of a file changed in place shows the new contents, so
+    // there is nothing reliable to compare with. One replaced by another
+    // file, or copied after it shrank, still has the old lines to diff.
+    if (data.isMapped(fileName)) {
+        uint32_t y = posY;
+        uint32_t r = row;
+        if (!readFile(fileName)) return false;
+        changed = data.size();
+        posY = data.has(y) ? y : (data.empty() ? 0 : data.size() - 1);
+        row = std::min(r, posY);
+        sanitizePos();
+        return true;
+    }
+
+    PieceTable fresh;
+    if (!readTable(fileName, fresh)) return false;
+    data.commit();
+    std::vector<DiffHunk> hunks = diffLines(
+        data.size(), [&](uint32_t y) { return data.line(y); },
+        fresh.size(), [&](uint32_t y) { return fresh.line(y); });
+
+    // Bottom up, so the hunks above keep their positions
+    invalidateLineInfo();
+    std::vector<std::string_view> lines;
+    for (auto it = hunks.rbegin(); it != hunks.rend(); ++it) {
+        if (it->oldCount > 0) data.erase(it->oldStart, it->oldCount);
+        lines.clear();
+        for (uint32_t l = 0; l < it->newCount; ++l) lines.push_back(fresh.line(it->newStart + l));
+        if (!lines.empty()) data.insert(it->oldStart, lines);
+        changed += std::max(it->oldCount, it->newCount);
+    }
+
+    posY = mapLine(hunks, posY);
+    row = mapLine(hunks, row);
+    if (!data.has(posY)) posY = data.empty() ? 0 : data.size() - 1;
+    row = std::min(row, posY);
+    sanitizePos();
+
+    if (journal.isOpen()) journal.create(fileName);
+    watchFile();
+    savedChanges = changes;
+    return true;
+}
+
+void Buffer::startJournal()
+{
+    // A journal left behind by a crash is kept until it is recovered
+    swapFound = !fileName.empty() && Journal::exists(fileName);
+    if (!fileName.empty() && !swapFound) journal.create(fileName);
+}
+
+bool Buffer::recover(uint64_t &records)
+{
+    if (!swapFound) return false;
+    invalidateLineInfo();
+    editPos.revision = UINT64_MAX;
+    if (!Journal::replay(fileName, data, records)) return false;
+    swapFound = false;
+    ++changes;
+    sanitizePos();
+    return journal.resume(fileName);
+}
+
+void Buffer::syncJournals(bool idle)
+{
+    for (Buffer *b : buffers) {
+        if (idle ? b->journal.pending() : b->journal.due()) b->journal.flush();
+    }
+}
+
+void Buffer::closeJournals(bool remove)
+{
+    for (Buffer *b : buffers) b->journal.close(remove);
+}
+
+void Buffer::pollFileEvents()
+{
+    for (Buffer *b : buffers) b->takeFileEvents();
+}
+
+bool Buffer::journalPending()
+{
+    for (Buffer *b : buffers) {
+        if (b->journal.pending()) return true;
+    }
+    return false;
+}
+
+void Buffer::expandTabs()
+{
+    invalidateLineInfo();
+    uint64_t cnt = data.size();
+    uint32_t jobs = std::min<uint64_t>(workerCount(), cnt / 4096 + 1);
+    std::vector<std::vector<std::pair<uint32_t, std::string>>> expanded(jobs);
+
+    // Lines are only read here, the piece table is updated afterwards in order
+    parallel(jobs, [&](uint32_t j) {
+        for (uint32_t y = cnt * j / jobs; y < cnt * (j + 1) / jobs; ++y) {
+            std::string_view l = data.line(y);
+            if (l.find('\t') != std::string_view::npos) expanded[j].push_back(std::make_pair(y, tabsToSpace(l)));
+        }
+    });
+    for (const std::vector<std::pair<uint32_t, std::string>> &e : expanded) {
+        for (const std::pair<uint32_t, std::string> &l : e) data.update(l.first, l.second);
+    }
+}
+
+void Buffer::detectLineEnding()
+{
+    // Lines keep their \r, the ending only matters for lines added here
+    std::string_view first = data.has(0) ? data.line(0) : std::string_view();
+    lineEnding = !first.empty() && first.back() == '\r' ? "\r\n" : "\n";
+}
+
+std::string_view Buffer::endingFor(std::string_view line) const
+{
+    // Lines carried over from a \r\n file still end in \r
+    if (!line.empty() && line.back() == '\r') return "\n";
+    return lineEnding;
+}
+
+void Buffer::snapshot(SaveJob &job) const
+{
+    job.setOriginal(data.originalStorage(), data.originalBase(), data.originalLength(), data.originalFd(), data.originalStatus());
+    data.forEachBlock([&](std::string_view text, bool whole) {
+        if (whole) {
+            job.addOriginal(text);
+        } else {
+            job.addCopy(text);
+            job.addCopy(endingFor(text));
+        }
+        return true;
+    });
+}
+
 bool Buffer::writeFile(std::string filename)
 {
-    std::ofstream fd(filename);
-    if (!fd.is_open()) return false;
+    SaveJob job;
+    snapshot(job);
+    // Only when the mapped file keeps its layout are the changed lines
+    // written into it, otherwise a temporary file replaces it
+    uint64_t mark = journal.mark();
+    if (!job.run(filename, data.isMapped(filename) && job.sameLayout(), syncOnSave)) return false;
+
+    savedBytes = job.size();
+    saveSeconds = job.seconds();
     fileName = filename;
+    if (!swapFound) journal.restart(fileName, mark);
+    savedChanges = changes;
+    watchFile();
+    return true;
+}
 
-    for (std::string line : data) fd << line + lineEnding;
-    fd.close();
+bool Buffer::startWrite(std::string filename)
+{
+    if (save) return false;
+    save.reset(new SaveJob());
+    snapshot(*save);
+    saveName = filename;
+    journalMark = journal.mark();
+    saveChanges = changes;
+    save->start(filename, data.isMapped(filename) && save->sameLayout(), syncOnSave);
     return true;
 }
 
-void Buffer::addLine(std::string line)
+uint32_t Buffer::writeProgress() const
+{
+    if (!save || save->size() == 0) return 100;
+    return save->progress() * 100 / save->size();
+}
+
+bool Buffer::finishWrite()
+{
+    if (!save) return false;
+    bool ok = save->wait();
+    if (ok) {
+        savedBytes = save->size();
+        saveSeconds = save->seconds();
+        fileName = saveName;
+        // Edits made during the save stay in the journal
+        if (!swapFound) journal.restart(fileName, journalMark);
+        savedChanges = saveChanges;
+    }
+    save.reset();
+    if (ok) watchFile();
+    return ok;
+}
+
+void Buffer::addLine(std::string_view line)
 {
+    invalidateLineInfo();
+    ++changes;
+    journal.insertLine(data.size(), line);
     data.push_back(line);
 }
 
-void Buffer::insertLine(std::string line)
+void Buffer::insertLine(std::string_view line)
 {
-    if (data.empty()) data.push_back(line);
-    else data.insert(data.begin() + posY + 1, line);
+    invalidateLineInfo();
+    uint32_t y = data.empty() ? 0 : posY + 1;
+    ++changes;
+    journal.insertLine(y, line);
+    data.insert(y, line);
 }
 
-void Buffer::updateLine(std::string line)
+void Buffer::insertLines(const std::vector<std::string> &lines, uint32_t cnt)
 {
-    while (posY >= data.size()) addLine("");
-    data[posY] = line;
+    if (lines.empty() || cnt == 0) return;
+    invalidateLineInfo();
+
+    std::vector<std::string_view> text;
+    text.reserve(lines.size() * cnt);
+    for (uint32_t c = 0; c < cnt; ++c) text.insert(text.end(), lines.begin(), lines.end());
+
+    // Cursor ends up on the last new line, with the column clamped the
+    // same way as when moving down through each of them
+    for (std::string_view l : text) {
+        uint32_t ll = utf8_length(l);
+        posX = std::min<uint32_t>(posX, ll > 0 ? ll - 1 : ll);
+    }
+    ++changes;
+    if (data.empty()) {
+        journal.insertLines(0, text);
+        data.insert(0, text);
+        posY = text.size() - 1;
+    } else {
+        journal.insertLines(posY + 1, text);
+        data.insert(posY + 1, text);
+        posY += text.size();
+    }
 }
 
 void Buffer::deleteLine(uint32_t cnt)
 {
-    uint32_t origY = posY;
-    while (cnt > 0 && !data.empty()) {
-        data.erase(data.begin() + posY);
-        if (posY >= data.size()) posY = data.size() - 1;
-        if (posY < origY) break;
-        --cnt;
+    invalidateLineInfo();
+    ++changes;
+    journal.erase(posY, cnt);
+    data.erase(posY, cnt);
+    if (!data.has(posY)) posY = data.empty() ? 0 : data.size() - 1;
+    sanitizePos();
+}
+
+bool Buffer::follow(uint32_t limit)
+{
+    if (!watcher.isOpen()) return false;
+    // Appended lines are not journaled, but edits made before are kept
+    // for recovery until they are saved
+    journal.close(!modified());
+    followed = true;
+    followLimit = limit;
+    followPos = data.originalLength();
+    followOpen = followPos > 0 && data.originalBase()[followPos - 1] != '\n';
+    trimToLimit();
+    return true;
+}
+
+bool Buffer::readAppended()
+{
+    if (!fileEventsPending()) return false;
+    uint32_t events = fileEvents;
+    fileEvents = 0;
+
+    struct stat st;
+    if ((events & FileWatcher::Replaced) || stat(fileName.c_str(), &st) != 0 ||
+        static_cast<uint64_t>(st.st_size) < followPos) {
+        // Rotated or truncated, start over with what is there now,
+        // unless that would throw away unsaved edits
+        if (modified()) {
+            followed = false;
+            return false;
+        }
+        uint32_t limit = followLimit;
+        readFile(fileName);
+        follow(limit);
+        gotoY();
+        return true;
+    }
+    if (static_cast<uint64_t>(st.st_size) == followPos) return false;
+
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    std::string text(st.st_size - followPos, '\0');
+    ssize_t got = pread(fd, &text[0], text.length(), followPos);
+    close(fd);
+    if (got <= 0) return false;
+    text.resize(got);
+    followPos += got;
+    appendText(text);
+    return true;
+}
+
+void Buffer::appendText(std::string_view text)
+{
+    invalidateLineInfo();
+    bool atEnd = data.empty() || !data.has(posY + 1);
+
+    // Rest of a line that was still being written
+    if (followOpen && !data.empty()) {
+        std::string_view::size_type nl = text.find('\n');
+        uint32_t last = data.size() - 1;
+        data.update(last, std::string(data.line(last)).append(text.substr(0, nl)));
+        text.remove_prefix(nl == std::string_view::npos ? text.length() : nl + 1);
+        followOpen = nl == std::string_view::npos;
+    }
+
+    std::vector<std::string_view> lines;
+    while (!text.empty()) {
+        std::string_view::size_type nl = text.find('\n');
+        lines.push_back(text.substr(0, nl));
+        followOpen = nl == std::string_view::npos;
+        text.remove_prefix(followOpen ? text.length() : nl + 1);
     }
+    if (!lines.empty()) data.insert(data.size(), lines);
+
+    trimToLimit();
+    // Stays at the end when it was there, like tail -f
+    if (atEnd && !data.empty()) posY = data.size() - 1;
+    sanitizePos();
+}
+
+void Buffer::trimToLimit()
+{
+    if (followLimit == 0 || data.size() <= followLimit) return;
+    uint32_t excess = data.size() - followLimit;
+    invalidateLineInfo();
+    data.erase(0, excess);
+    posY = posY > excess ? posY - excess : 0;
+    row = row > excess ? row - excess : 0;
     sanitizePos();
 }
 
-const std::string Buffer::line() const
+std::string_view Buffer::line() const
+{
+    if (!data.has(posY)) return "";
+    return data.line(posY);
+}
+
+void Buffer::commitLine()
+{
+    data.commit();
+}
+
+editor::GapBuffer &Buffer::editLine()
+{
+    // Unless the cursor is where the last edit left it, find the spot again
+    if (editPos.revision != data.revision() || editPos.y != posY || editPos.x != posX) {
+        while (!data.has(posY)) addLine("");
+        std::string_view a, b;
+        data.line(posY, a, b);
+        editPos.offset = lineInfo().index().offset(a, b, posX);
+        editPos.length = lineLength();
+        data.edit(posY);
+        editPos.revision = data.revision();
+        editPos.x = posX;
+        editPos.y = posY;
+    }
+    GapBuffer &l = data.current();
+    l.moveTo(editPos.offset);
+    return l;
+}
+
+void Buffer::editDone(uint32_t gapX, bool expand)
+{
+    // Same as sanitizePos(), without measuring the line again
+    uint32_t ll = editPos.length;
+    if (expand) posX = std::min<uint32_t>(posX, ll);
+    else posX = std::min<uint32_t>(posX, ll > 0 ? ll - 1 : ll);
+
+    std::string_view b = data.current().before();
+    editPos.offset = retreatChars(b.data(), b.data() + b.length(), gapX - posX) - b.data();
+    editPos.x = posX;
+}
+
+const editor::LineInfo &Buffer::lineInfo() const
 {
-    if (posY >= data.size()) return "";
-    return data[posY];
+    if (infoY != posY) {
+        std::string_view a, b;
+        if (data.has(posY)) data.line(posY, a, b);
+        info.update(a, b, tabSize);
+        infoY = posY;
+    }
+    return info;
 }
 
 uint32_t Buffer::lineLength() const
 {
-    if (posY >= data.size()) return 0;
-    return utf8_length(data[posY]);
+    return lineInfo().length();
 }
 
 void Buffer::gotoY(uint32_t y)
 {
-    if (y == 0 || y > data.size()) y = data.size();
+    if (y == 0 || !data.has(y - 1)) y = data.size();
     posY = y - 1;
     sanitizePos();
 }
 
-const std::vector<std::string> Buffer::copyLines(uint32_t cnt) const
+std::vector<std::string> Buffer::copyLines(uint32_t cnt) const
 {
     std::vector<std::string> res;
-    if (posY >= data.size()) return res;
-    uint32_t target = std::min<uint32_t>(posY + cnt, data.size());
-    for (uint32_t l = posY; l < target; ++l) {
-        res.push_back(data[l]);
+    for (uint32_t l = posY; l - posY < cnt && data.has(l); ++l) {
+        res.emplace_back(data.line(l));
     }
     return res;
 }
 
-const std::vector<std::string> Buffer::copyLinesUp(uint32_t cnt) const
+std::vector<std::string> Buffer::copyLinesUp(uint32_t cnt) const
 {
     std::vector<std::string> res;
-    if (posY >= data.size()) return res;
+    if (!data.has(posY)) return res;
     if (cnt > posY) cnt = posY;
-    uint32_t src = std::min<uint32_t>(posY - cnt, data.size());
-    for (uint32_t l = src; l <= posY; ++l) {
-        res.push_back(data[l]);
+    for (uint32_t l = posY - cnt; l <= posY; ++l) {
+        res.emplace_back(data.line(l));
     }
     return res;
 }
@@ -163,40 +645,36 @@ void Buffer::sanitizePos(bool expand)
     uint32_t ll = lineLength();
     if (expand) posX = std::min<uint32_t>(posX, ll);
     else posX = std::min<uint32_t>(posX, ll > 0 ? ll - 1 : ll);
-    if (data.size() > 0) posY = std::min<uint32_t>(posY, data.size() - 1);
-    else posY = 0;
+    if (!data.has(posY)) posY = data.size() > 0 ? data.size() - 1 : 0;
 }
 
 uint32_t Buffer::tabs() const
 {
-    std::string l = line();
-    uint32_t res = 0;
-    for (uint32_t p = 0; p < posX; ++p) {
-        char c = utf8_at(l, p);
-        if (c == '\t') ++res;
-    }
-    return res;
+    return lineInfo().tabsBefore(posX);
 }
 
 uint32_t Buffer::tabExtra() const
 {
-    std::string l = line();
+    return lineInfo().tabExtraBefore(posX);
+}
+
+uint32_t Buffer::screenX(uint32_t limit) const
+{
+    if (lineInfo().ascii()) return posX + tabExtra();
 
-    uint32_t res = 0;
+    std::string_view parts[2];
+    if (data.has(posY)) data.line(posY, parts[0], parts[1]);
     uint32_t pos = 0;
-    for (uint32_t p = 0; p < posX; ++p) {
-        char c = utf8_at(l, p);
-        if (c == '\t') {
-            ++pos;
-            while (pos % tabSize != 0) {
-                ++pos;
-                ++res;
-            }
-        } else {
+    uint32_t col = 0;
+    for (std::string_view part : parts) {
+        const char *p = part.data();
+        const char *end = p + part.length();
+        while (p < end && pos < posX && col < limit) {
+            col += columns(utf8_decode(p, end), col, tabSize);
             ++pos;
         }
     }
-    return res;
+    return col;
 }
 
 void Buffer::cursorLeft(uint32_t cnt)
@@ -252,20 +730,19 @@ void Buffer::pageDown(uint32_t pageSize, uint32_t cnt)
 
 void Buffer::cursorWord(uint32_t cnt)
 {
-    std::string nowline = line();
-    uint32_t ll = utf8_length(nowline);
-    if (posX >= ll) {
+    if (posX >= lineLength()) {
         ++posY;
         posX = 0;
-        nowline = line();
     }
-    for (uint32_t p = posX + 1; p < ll; ++p) {
-        char n = utf8_at(nowline, p);
-        if (delimiters.find(n) != std::string::npos) {
+    std::string_view nowline = line();
+    const char *end = nowline.data() + nowline.size();
+    const char *c = advanceChars(nowline.data(), end, posX + 1);
+    for (uint32_t p = posX + 1; c < end; ++p, c = nextChar(c, end)) {
+        if (delimiters.find(*c) != std::string::npos) {
             posX = p;
-            while (delimiters.find(n) != std::string::npos) {
+            while (c < end && delimiters.find(*c) != std::string::npos) {
                 ++posX;
-                n = utf8_at(nowline, posX);
+                c = nextChar(c, end);
             }
             sanitizePos();
             if (--cnt > 0) cursorWord(cnt);
@@ -279,18 +756,19 @@ void Buffer::cursorWord(uint32_t cnt)
 
 void Buffer::cursorWordBack(uint32_t cnt)
 {
-    std::string nowline = line();
     if (posX == 0 && posY > 0) {
         --posY;
         posX = lineLength();
-        nowline = line();
     }
+    std::string_view nowline = line();
+    const char *begin = nowline.data();
+    const char *c = advanceChars(begin, begin + nowline.size(), posX);
     uint32_t prevPos = posX;
-    for (uint32_t p = posX - 1; p > 0; --p) {
-        char n = utf8_at(nowline, p);
-        if (delimiters.find(n) != std::string::npos) {
-            posX = p;
-            if (posX > 0) ++posX;
+    for (uint32_t p = posX; p > 1 && c > begin; ) {
+        c = prevChar(begin, c);
+        --p;
+        if (delimiters.find(*c) != std::string::npos) {
+            posX = p + 1;
             sanitizePos();
             if (posX != prevPos) {
                 if (--cnt > 0) cursorWordBack(cnt);
@@ -309,30 +787,52 @@ void Buffer::backspaceChars(uint32_t cnt)
         // FIXME TODO delete from prev line
         return;
     }
-    std::string l = line();
-    updateLine(substrSafe(l, 0, posX > cnt ? posX - cnt : 0) + substrSafe(l, posX));
+    GapBuffer &l = editLine();
+    uint32_t from = std::min(posX > cnt ? posX - cnt : 0, editPos.length);
+    uint32_t erased = std::min(posX, editPos.length) - from;
+    std::string_view b = l.before();
+    const char *end = b.data() + b.length();
+    size_t bytes = end - retreatChars(b.data(), end, erased);
+    l.eraseBefore(bytes);
+    journal.eraseText(posY, l.gap(), bytes);
+    if (infoY == posY) info.erase(from, l.gap(), erased, bytes);
+    ++changes;
+    editPos.length -= erased;
 
     if (posX <= cnt) posX = 0;
     else posX -= cnt;
-    sanitizePos();
+    editDone(from);
 }
 
 void Buffer::deleteChars(uint32_t cnt)
 {
-    std::string l = line();
-    updateLine(substrSafe(l, 0, posX) + substrSafe(l, posX + cnt));
-    sanitizePos();
+    GapBuffer &l = editLine();
+    uint32_t from = std::min(posX, editPos.length);
+    uint32_t erased = std::min(posX + cnt, editPos.length) - from;
+    std::string_view a = l.after();
+    size_t bytes = advanceChars(a.data(), a.data() + a.length(), erased) - a.data();
+    l.eraseAfter(bytes);
+    journal.eraseText(posY, l.gap(), bytes);
+    if (infoY == posY) info.erase(from, l.gap(), erased, bytes);
+    ++changes;
+    editPos.length -= erased;
+    editDone(from);
+}
+
+std::string Buffer::tabsToSpace(std::string_view d) const
+{
+    if (!tabsToSpaces) return std::string(d);
+    return tabsExpanded(d);
 }
 
-std::string Buffer::tabsToSpace(const std::string &d) const
+std::string Buffer::tabsExpanded(std::string_view d) const
 {
-    if (!tabsToSpaces) return d;
     std::string res;
 
-    uint32_t ll = utf8_length(d);
+    Utf8Index idx(d);
     uint32_t pos = 0;
-    for (uint32_t f = 0; f < ll; ++f) {
-        std::string c = utf8_at_str(d, f);
+    for (uint32_t f = 0; f < idx.length(); ++f) {
+        std::string_view c = utf8_at_str(d, idx, f);
         if (c == "\t") {
             uint32_t origPos = pos;
             ++pos;
@@ -346,29 +846,65 @@ std::string Buffer::tabsToSpace(const std::string &d) const
     return res;
 }
 
-void Buffer::append(std::string d)
-{
-    std::string l = line();
-    std::string pre = substrSafe(l, 0, posX);
-    std::string post = substrSafe(l, posX);
-    std::string d2;
-
-    uint32_t ld = utf8_length(d);
-    for (uint32_t f = 0; f < ld; ++f) {
-        std::string c = utf8_at_str(d, f);
-        if (c == "\t") {
-            uint32_t origPos = posX;
-            ++posX;
-            while (posX % tabSize != 0)  ++posX;
-            d2 += spaces(posX - origPos);
-        } else {
-            d2 += c;
-            ++posX;
-        }
+void Buffer::append(std::string_view d)
+{
+    GapBuffer &l = editLine();
+    uint32_t start = std::min(posX, editPos.length);
+    uint32_t gapX = start;
+    size_t offset = l.gap();
+
+    // Text goes straight into the gap, tabs are expanded to spaces on the way
+    while (!d.empty()) {
+        std::string_view::size_type tab = d.find('\t');
+        std::string_view run = d.substr(0, tab);
+        uint32_t cnt = utf8_length(run);
+        l.insert(run);
+        posX += cnt;
+        gapX += cnt;
+        if (tab == std::string_view::npos) break;
+
+        uint32_t origPos = posX;
+        ++posX;
+        while (posX % tabSize != 0)  ++posX;
+        l.insert(posX - origPos, ' ');
+        gapX += posX - origPos;
+        d.remove_prefix(tab + 1);
+    }
+    journal.insertText(posY, offset, l.before().substr(offset));
+    if (infoY == posY) info.insert(start, offset, l.before().substr(offset));
+    ++changes;
+    editPos.length += gapX - start;
+    editDone(gapX, true);
+}
+
+void Buffer::insertText(std::string_view text)
+{
+    std::string_view::size_type nl = text.find_first_of("\r\n");
+    append(text.substr(0, nl));
+    if (nl == std::string_view::npos) return;
+    commitLine();
+    undoApplyLine();
+
+    // Same result as typing it, each line break starts a new line below
+    // with tabs expanded, but the piece table and journal see one insert
+    std::vector<std::string> lines;
+    while (nl != std::string_view::npos) {
+        text.remove_prefix(nl + (text.compare(nl, 2, "\r\n") == 0 ? 2 : 1));
+        nl = text.find_first_of("\r\n");
+        std::string_view l = text.substr(0, nl);
+        if (l.find('\t') == std::string_view::npos) lines.emplace_back(l);
+        else lines.push_back(tabsExpanded(l));
     }
+    std::vector<std::string_view> views(lines.begin(), lines.end());
+    for (size_t i = 0; i + 1 < lines.size(); ++i) undoLine(lines[i]);
 
-    updateLine(pre + d2 + post);
-    sanitizePos(true);
+    invalidateLineInfo();
+    uint32_t y = posY + 1;
+    ++changes;
+    journal.insertLines(y, views);
+    data.insert(y, views);
+    posY = y + lines.size() - 1;
+    posX = utf8_length(lines.back());
 }
 
 void Buffer::append(char d)
@@ -396,38 +932,31 @@ std::string Buffer::spaces(uint32_t cnt) const
     return res;
 }
 
-std::string Buffer::handleSpecial(std::string line) const
+void Buffer::renderLine(uint32_t y, std::string &out, uint32_t width) const
 {
-    std::string res;
-    uint32_t pos = 0;
-    uint32_t ll = utf8_length(line);
-    for (uint32_t p = 0; p < ll; ++p) {
-        std::string s = utf8_at_str(line, p);
-        if (s == "\t") {
-            res += ' ';
-            ++pos;
-            while (pos % tabSize != 0) {
-                ++pos;
-                res += ' ';
-            }
-        } else {
-            ++pos;
-            res += s;
-        }
+    if (!data.has(y)) {
+        out += "~";
+        return;
     }
-    return res;
-}
-
-const std::vector<std::string> Buffer::viewport(uint32_t width, uint32_t height) const
-{
-    std::vector<std::string> res;
-    for (uint32_t i = 0; i < height; ++i) {
-        uint32_t filerow = i + row;
-        if (filerow >= data.size()) res.push_back("~");
-        else res.push_back(handleSpecial(data[filerow]));
+    std::string_view parts[2];
+    data.line(y, parts[0], parts[1]);
+
+    // Only what fits on the screen is expanded and copied
+    uint32_t col = 0;
+    for (std::string_view part : parts) {
+        const char *p = part.data();
+        const char *end = p + part.length();
+        while (p < end) {
+            const char *start = p;
+            uint32_t c = utf8_decode(p, end);
+            uint32_t w = columns(c, col, tabSize);
+            // Combining marks of the last character shown still go out
+            if (col >= width && w != 0) return;
+            if (c == '\t') out.append(w, ' ');
+            else out.append(start, p - start);
+            col += w;
+        }
     }
-
-    return res;
 }
 
 void Buffer::undoAdd(UndoableAction act)
@@ -448,5 +977,10 @@ void Buffer::undoRecordPostPos()
 
 void Buffer::undoApplyLine()
 {
-    undos.last()->addLine(line());
+    undoLine(line());
+}
+
+void Buffer::undoLine(std::string_view l)
+{
+    undos.last()->addLine(std::string(l));
 }
@@ -0,0 +1,95 @@
+#include "eventloop.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+
+using editor::EventLoop;
+
+static EventLoop *loop = nullptr;
+static int wakeRead = -1;
+static int wakeWrite = -1;
+static volatile sig_atomic_t resized = 0;
+
+static void onResize(int)
+{
+    resized = 1;
+    EventLoop::wake();
+}
+
+EventLoop *EventLoop::get()
+{
+    if (loop == nullptr) {
+        loop = new EventLoop();
+    }
+    return loop;
+}
+
+EventLoop::EventLoop()
+{
+    int p[2];
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) == 0) {
+        wakeRead = p[0];
+        wakeWrite = p[1];
+    }
+    fds.push_back({ STDIN_FILENO, POLLIN, 0 });
+    fds.push_back({ wakeRead, POLLIN, 0 });
+
+    struct sigaction sa = {};
+    sa.sa_handler = onResize;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, nullptr);
+}
+
+void EventLoop::watch(int fd)
+{
+    if (fd < 0) return;
+    fds.push_back({ fd, POLLIN, 0 });
+}
+
+void EventLoop::unwatch(int fd)
+{
+    fds.erase(std::remove_if(fds.begin() + 2, fds.end(),
+        [fd](const struct pollfd &p) { return p.fd == fd; }), fds.end());
+}
+
+void EventLoop::wake()
+{
+    if (wakeWrite < 0) return;
+    int saved = errno;
+    // A full pipe already wakes the loop
+    ssize_t res = write(wakeWrite, "", 1);
+    (void)res;
+    errno = saved;
+}
+
+uint32_t EventLoop::wait(int timeoutMs)
+{
+    uint32_t events = 0;
+    while (events == 0) {
+        if (resized) {
+            resized = 0;
+            events |= Resize;
+        }
+        for (struct pollfd &p : fds) p.revents = 0;
+        int res = poll(fds.data(), fds.size(), events ? 0 : timeoutMs);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return events | Timeout;
+        }
+        if (res == 0) return events ? events : Timeout;
+
+        if (fds[0].revents) events |= Input;
+        if (fds[1].revents) {
+            char buf[64];
+            while (read(wakeRead, buf, sizeof(buf)) > 0) {}
+            events |= Wakeup;
+        }
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents) events |= Descriptor;
+        }
+    }
+    return events;
+}
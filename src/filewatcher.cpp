@@ -0,0 +1,66 @@
+#include "filewatcher.hh"
+#include "eventloop.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+using editor::FileWatcher;
+using editor::EventLoop;
+
+FileWatcher::FileWatcher() :
+    fd(-1),
+    wd(-1)
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+    close();
+}
+
+bool FileWatcher::watch(const std::string &filename)
+{
+    close();
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return false;
+    wd = inotify_add_watch(fd, filename.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (wd < 0) {
+        close();
+        return false;
+    }
+    EventLoop::get()->watch(fd);
+    return true;
+}
+
+void FileWatcher::close()
+{
+    if (fd >= 0) {
+        EventLoop::get()->unwatch(fd);
+        ::close(fd);
+    }
+    fd = -1;
+    wd = -1;
+}
+
+uint32_t FileWatcher::poll()
+{
+    if (fd < 0) return 0;
+    uint32_t res = 0;
+    alignas(struct inotify_event) char buf[4096];
+    while (true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event ev;
+            memcpy(&ev, p, sizeof(ev));
+            if (ev.mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) res |= Replaced;
+            else res |= Modified;
+            p += sizeof(ev) + ev.len;
+        }
+    }
+    return res;
+}
@@ -0,0 +1,209 @@
+#include "filewriter.hh"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using editor::FileWriter;
+
+// Smaller ranges are cheaper to write from memory than to copy in the kernel
+static const uint64_t minCopy = 64 * 1024;
+
+static std::string directoryOf(const std::string &path)
+{
+    std::string::size_type slash = path.rfind('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+FileWriter::FileWriter() :
+    fd(-1),
+    inPlace(false),
+    canCopy(true),
+    queued(0),
+    position(0),
+    bytes(0)
+{
+    queue.reserve(IOV_MAX);
+}
+
+FileWriter::~FileWriter()
+{
+    abort();
+}
+
+bool FileWriter::open(const std::string &filename)
+{
+    abort();
+
+    // Through a symlink the file it points to gets replaced, not the link
+    char *real = realpath(filename.c_str(), nullptr);
+    target = real != nullptr ? real : filename;
+    free(real);
+
+    std::string dir = directoryOf(target);
+    std::string name = target.substr(target.rfind('/') + 1);
+    tempName = dir + "/." + name + ".XXXXXX";
+    fd = mkostemp(&tempName[0], O_CLOEXEC);
+    if (fd < 0) {
+        tempName.clear();
+        return false;
+    }
+    inPlace = false;
+    position = 0;
+    bytes = 0;
+    return true;
+}
+
+bool FileWriter::openInPlace(const std::string &filename, const struct stat &expected)
+{
+    abort();
+    target = filename;
+    fd = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_dev != expected.st_dev || st.st_ino != expected.st_ino ||
+        st.st_size != expected.st_size || st.st_mtim.tv_sec != expected.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != expected.st_mtim.tv_nsec) {
+        abort();
+        return false;
+    }
+    inPlace = true;
+    position = 0;
+    bytes = 0;
+    return true;
+}
+
+bool FileWriter::write(std::string_view data)
+{
+    if (fd < 0) return false;
+    if (data.empty()) return true;
+    if (queue.size() == IOV_MAX && !flush()) return false;
+    queue.push_back(iovec{const_cast<char*>(data.data()), data.length()});
+    queued += data.length();
+    return true;
+}
+
+bool FileWriter::skip(uint64_t cnt)
+{
+    if (!flush()) return false;
+    position += cnt;
+    return true;
+}
+
+bool FileWriter::copy(int from, uint64_t offset, std::string_view data)
+{
+    if (from < 0 || !canCopy || data.length() < minCopy) return write(data);
+    if (!flush()) return false;
+
+    loff_t in = offset;
+    loff_t out = position;
+    uint64_t left = data.length();
+    while (left > 0) {
+        ssize_t res = copy_file_range(from, &in, fd, &out, left, 0);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+            // Not supported between these files, the rest goes through memory
+            if (res < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) return false;
+            canCopy = false;
+            position = out;
+            return write(data.substr(data.length() - left));
+        }
+        left -= res;
+        bytes += res;
+    }
+    position = out;
+    return true;
+}
+
+bool FileWriter::flush()
+{
+    if (fd < 0) return false;
+
+    size_t first = 0;
+    while (first < queue.size()) {
+        ssize_t res = pwritev(fd, &queue[first], queue.size() - first, position);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        position += res;
+        bytes += res;
+
+        // Skip what was written, a partial write can end inside an iovec
+        size_t done = res;
+        while (first < queue.size() && done >= queue[first].iov_len) {
+            done -= queue[first].iov_len;
+            ++first;
+        }
+        if (done > 0) {
+            queue[first].iov_base = static_cast<char*>(queue[first].iov_base) + done;
+            queue[first].iov_len -= done;
+        }
+    }
+    queue.clear();
+    queued = 0;
+    return true;
+}
+
+bool FileWriter::commit(bool sync)
+{
+    if (!flush()) return false;
+    if (inPlace) {
+        bool ok = !sync || fsync(fd) == 0;
+        if (::close(fd) != 0) ok = false;
+        fd = -1;
+        return ok;
+    }
+
+    // Failing to copy permissions or owner does not fail the save, the
+    // file is then left as mkostemp() created it
+    struct stat st;
+    int res;
+    if (stat(target.c_str(), &st) == 0) {
+        res = fchmod(fd, st.st_mode & 07777);
+        (void)res;
+        // Only succeeds with enough privileges, otherwise the saving user owns it
+        res = fchown(fd, st.st_uid, st.st_gid);
+        (void)res;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        res = fchmod(fd, 0666 & ~mask);
+        (void)res;
+    }
+
+    if (sync && fsync(fd) != 0) return false;
+    if (::close(fd) != 0) {
+        fd = -1;
+        return false;
+    }
+    fd = -1;
+    if (rename(tempName.c_str(), target.c_str()) != 0) return false;
+    tempName.clear();
+
+    if (sync) {
+        // Makes the rename itself durable
+        int dir = ::open(directoryOf(target).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir >= 0) {
+            fsync(dir);
+            ::close(dir);
+        }
+    }
+    return true;
+}
+
+void FileWriter::abort()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    if (!tempName.empty()) unlink(tempName.c_str());
+    tempName.clear();
+    queue.clear();
+    queued = 0;
+}
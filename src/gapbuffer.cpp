@@ -0,0 +1,81 @@
+#include "gapbuffer.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using editor::GapBuffer;
+
+static const size_t minGap = 64;
+
+GapBuffer::GapBuffer() :
+    gapStart(0),
+    gapEnd(0)
+{
+}
+
+void GapBuffer::assign(std::string_view s)
+{
+    buf.assign(s.data(), s.length());
+    gapStart = s.length();
+    // Whatever capacity the string already has becomes the gap
+    buf.resize(buf.capacity());
+    gapEnd = buf.length();
+}
+
+void GapBuffer::moveTo(size_t pos) const
+{
+    pos = std::min(pos, length());
+    char *p = &buf[0];
+    if (pos < gapStart) {
+        size_t cnt = gapStart - pos;
+        memmove(p + gapEnd - cnt, p + pos, cnt);
+        gapStart -= cnt;
+        gapEnd -= cnt;
+    } else if (pos > gapStart) {
+        size_t cnt = pos - gapStart;
+        memmove(p + gapStart, p + gapEnd, cnt);
+        gapStart += cnt;
+        gapEnd += cnt;
+    }
+}
+
+void GapBuffer::reserve(size_t cnt)
+{
+    if (gapEnd - gapStart >= cnt) return;
+
+    size_t tail = buf.length() - gapEnd;
+    size_t size = std::max(buf.length() * 2, length() + cnt + minGap);
+    buf.resize(size);
+    memmove(&buf[0] + size - tail, &buf[0] + gapEnd, tail);
+    gapEnd = size - tail;
+}
+
+void GapBuffer::insert(std::string_view s)
+{
+    reserve(s.length());
+    memcpy(&buf[0] + gapStart, s.data(), s.length());
+    gapStart += s.length();
+}
+
+void GapBuffer::insert(size_t cnt, char c)
+{
+    reserve(cnt);
+    memset(&buf[0] + gapStart, c, cnt);
+    gapStart += cnt;
+}
+
+void GapBuffer::eraseBefore(size_t cnt)
+{
+    gapStart -= std::min(cnt, gapStart);
+}
+
+void GapBuffer::eraseAfter(size_t cnt)
+{
+    gapEnd += std::min(cnt, buf.length() - gapEnd);
+}
+
+std::string_view GapBuffer::view() const
+{
+    moveTo(length());
+    return before();
+}
@@ -0,0 +1,240 @@
+#include "indexcache.hh"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <climits>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using editor::IndexCache;
+
+static const char magic[8] = { 'M', 'I', 'V', 'I', '0', '0', '2', '\n' };
+// Indexes are dropped when unused for this long, and the least recently
+// used ones go first when all of them take more than cacheLimit
+static const time_t maxAge = 30 * 24 * 60 * 60;
+static const uint64_t cacheLimit = 1024ull * 1024 * 1024;
+// Temporary files of a store that never finished
+static const time_t maxTempAge = 60 * 60;
+
+// Followed by the line starts and then the name of the indexed file
+struct Header {
+    char magic[8];
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t count;
+    uint64_t valid;
+    uint64_t pathLength;
+};
+
+static std::string cacheName(const std::string &dir, const struct stat &st)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%llx-%llx.idx",
+        static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino));
+    return dir + name;
+}
+
+static Header headerFor(const struct stat &st)
+{
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(magic));
+    h.size = st.st_size;
+    h.mtimeSec = st.st_mtim.tv_sec;
+    h.mtimeNsec = st.st_mtim.tv_nsec;
+    return h;
+}
+
+// Starts are offsets of lines in order, the last one is one past a final
+// line without a newline
+static bool validStarts(const uint64_t *starts, uint64_t count, uint64_t size)
+{
+    if (starts[0] != 0 || starts[count - 1] > size + 1) return false;
+    for (uint64_t i = 1; i < count - 1; ++i) {
+        if (starts[i] < starts[i - 1] || starts[i] > size) return false;
+    }
+    return starts[count - 1] >= starts[count - 2];
+}
+
+IndexCache::IndexCache() :
+    file(),
+    base(nullptr),
+    length(0),
+    lineStarts(nullptr),
+    startCount(0),
+    valid(true)
+{
+}
+
+IndexCache::~IndexCache()
+{
+    close();
+    if (writer.joinable()) writer.join();
+}
+
+std::string IndexCache::directory()
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != nullptr && xdg[0] == '/') return std::string(xdg) + "/miv";
+    const char *home = getenv("HOME");
+    if (home == nullptr || home[0] == 0) return "";
+    return std::string(home) + "/.cache/miv";
+}
+
+bool IndexCache::open(int fd, const std::string &filename)
+{
+    close();
+    name.clear();
+    dir = directory();
+    char full[PATH_MAX];
+    if (dir.empty() || fstat(fd, &file) != 0 || realpath(filename.c_str(), full) == nullptr) return false;
+    name = cacheName(dir, file);
+    path = full;
+
+    int in = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) return false;
+    struct stat cs;
+    void *m = MAP_FAILED;
+    if (fstat(in, &cs) == 0 && static_cast<size_t>(cs.st_size) >= sizeof(Header)) {
+        m = mmap(nullptr, cs.st_size, PROT_READ, MAP_SHARED, in, 0);
+    }
+    ::close(in);
+    if (m == MAP_FAILED) return false;
+    base = m;
+    length = cs.st_size;
+
+    Header h;
+    memcpy(&h, base, sizeof(h));
+    Header expect = headerFor(file);
+    if (memcmp(h.magic, expect.magic, sizeof(magic)) != 0 || h.size != expect.size ||
+        h.mtimeSec != expect.mtimeSec || h.mtimeNsec != expect.mtimeNsec ||
+        h.count < 2 || h.pathLength > length - sizeof(h) ||
+        (length - sizeof(h) - h.pathLength) / sizeof(uint64_t) != h.count) {
+        close();
+        return false;
+    }
+    const uint64_t *starts = reinterpret_cast<const uint64_t*>(static_cast<const char*>(base) + sizeof(h));
+    if (!validStarts(starts, h.count, h.size)) {
+        close();
+        return false;
+    }
+    lineStarts = starts;
+    startCount = h.count;
+    valid = h.valid != 0;
+    // Its modification time tells when it was last used
+    utimensat(AT_FDCWD, name.c_str(), nullptr, 0);
+    return true;
+}
+
+void IndexCache::close()
+{
+    if (base != nullptr) munmap(base, length);
+    base = nullptr;
+    length = 0;
+    lineStarts = nullptr;
+    startCount = 0;
+    valid = true;
+}
+
+bool IndexCache::store(const std::vector<uint64_t> &starts, bool valid) const
+{
+    if (name.empty()) return false;
+    if (writer.joinable()) writer.join();
+    // A copy, the table keeps changing its own
+    writer = std::thread([dir = dir, name = name, path = path, starts = starts, valid, file = file]() {
+        if (write(dir, name, path, starts, valid, file)) prune(dir, name);
+    });
+    return true;
+}
+
+bool IndexCache::write(const std::string &dir, const std::string &name, const std::string &path,
+    const std::vector<uint64_t> &starts, bool valid, const struct stat &file)
+{
+    std::string::size_type slash = dir.rfind('/');
+    if (slash != std::string::npos && slash > 0) mkdir(dir.substr(0, slash).c_str(), 0700);
+    mkdir(dir.c_str(), 0700);
+
+    Header h = headerFor(file);
+    h.count = starts.size();
+    h.valid = valid;
+    h.pathLength = path.length();
+
+    // Written aside and renamed, so a reader never maps half an index
+    std::string tmp = name + ".XXXXXX";
+    int out = mkostemp(&tmp[0], O_CLOEXEC);
+    if (out < 0) return false;
+    FILE *f = fdopen(out, "wb");
+    if (f == nullptr) {
+        ::close(out);
+        unlink(tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+        fwrite(starts.data(), sizeof(uint64_t), starts.size(), f) == starts.size() &&
+        fwrite(path.data(), 1, path.length(), f) == path.length();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), name.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void IndexCache::prune(const std::string &dir, const std::string &keep)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) return;
+
+    struct Entry {
+        std::string name;
+        time_t used;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    time_t now = time(nullptr);
+    while (struct dirent *e = readdir(d)) {
+        std::string entry = e->d_name;
+        std::string name = dir + "/" + entry;
+        struct stat cs;
+        if (name == keep || stat(name.c_str(), &cs) != 0 || !S_ISREG(cs.st_mode)) continue;
+        if (entry.find(".idx.") != std::string::npos) {
+            if (now - cs.st_mtim.tv_sec > maxTempAge) unlink(name.c_str());
+            continue;
+        }
+        if (entry.length() < 4 || entry.compare(entry.length() - 4, 4, ".idx") != 0) continue;
+
+        // Stale once the file it was made for changed or is gone
+        bool stale = true;
+        Header h;
+        int in = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in >= 0 && pread(in, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, magic, sizeof(magic)) == 0 &&
+            h.pathLength > 0 && h.pathLength < PATH_MAX && h.count < static_cast<uint64_t>(cs.st_size) / sizeof(uint64_t)) {
+            std::string path(h.pathLength, '\0');
+            struct stat st;
+            if (pread(in, &path[0], path.length(), sizeof(h) + h.count * sizeof(uint64_t)) == static_cast<ssize_t>(path.length()) &&
+                stat(path.c_str(), &st) == 0 && cacheName(dir, st) == name) {
+                Header current = headerFor(st);
+                stale = h.size != current.size || h.mtimeSec != current.mtimeSec || h.mtimeNsec != current.mtimeNsec;
+            }
+        }
+        if (in >= 0) ::close(in);
+        if (stale || now - cs.st_mtim.tv_sec > maxAge) unlink(name.c_str());
+        else entries.push_back(Entry{name, cs.st_mtim.tv_sec, static_cast<uint64_t>(cs.st_size)});
+    }
+    closedir(d);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used > b.used; });
+    struct stat ks;
+    uint64_t total = stat(keep.c_str(), &ks) == 0 ? ks.st_size : 0;
+    for (const Entry &e : entries) {
+        total += e.size;
+        if (total > cacheLimit) unlink(e.name.c_str());
+    }
+}
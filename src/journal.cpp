@@ -0,0 +1,310 @@
+#include "journal.hh"
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using editor::Journal;
+
+enum class Op : uint8_t {
+    InsertLines = 1,
+    Erase,
+    Update,
+    InsertText,
+    EraseText
+};
+
+static const char magic[8] = { 'M', 'I', 'V', 'J', '0', '0', '1', '\n' };
+// Magic and the size, modification time and inode of the file underneath
+static const uint64_t headerSize = sizeof(magic) + 4 * sizeof(uint64_t);
+static const size_t batchSize = 64 * 1024;
+static const std::chrono::seconds flushInterval(1);
+
+static void fileIdentity(const std::string &filename, uint64_t id[4])
+{
+    struct stat st;
+    memset(id, 0, 4 * sizeof(uint64_t));
+    if (stat(filename.c_str(), &st) != 0) return;
+    id[0] = st.st_size;
+    id[1] = st.st_mtim.tv_sec;
+    id[2] = st.st_mtim.tv_nsec;
+    id[3] = st.st_ino;
+}
+
+static bool writeAll(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(fd, p, len);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        p += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Reads the integers and strings written by Journal::put()
+class Reader
+{
+public:
+    Reader(std::string_view d) : data(d), pos(0), ok(true) {}
+
+    uint64_t get() {
+        uint64_t v = 0;
+        if (data.length() - pos < sizeof(v)) {
+            ok = false;
+            return 0;
+        }
+        memcpy(&v, data.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+    std::string_view text() {
+        uint64_t len = get();
+        if (!ok || data.length() - pos < len) {
+            ok = false;
+            return std::string_view();
+        }
+        std::string_view res = data.substr(pos, len);
+        pos += len;
+        return res;
+    }
+
+    std::string_view data;
+    uint64_t pos;
+    bool ok;
+};
+
+Journal::Journal() :
+    fd(-1),
+    size(0)
+{
+}
+
+Journal::~Journal()
+{
+    close(false);
+}
+
+std::string Journal::swapName(const std::string &filename)
+{
+    std::string::size_type slash = filename.rfind('/');
+    std::string dir = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+    std::string name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    return dir + "." + name + ".miv.swp";
+}
+
+bool Journal::exists(const std::string &filename)
+{
+    return access(swapName(filename).c_str(), F_OK) == 0;
+}
+
+bool Journal::create(const std::string &filename)
+{
+    close(false);
+    path = swapName(filename);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+
+    uint64_t id[4];
+    fileIdentity(filename, id);
+    std::string header(magic, sizeof(magic));
+    header.append(reinterpret_cast<const char*>(id), sizeof(id));
+    if (!writeAll(fd, header.data(), header.length())) {
+        close(true);
+        return false;
+    }
+    size = header.length();
+    lastFlush = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool Journal::resume(const std::string &filename)
+{
+    close(false);
+    path = swapName(filename);
+    fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return false;
+    off_t end = lseek(fd, 0, SEEK_END);
+    size = end < 0 ? 0 : end;
+    lastFlush = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool Journal::restart(const std::string &filename, uint64_t from)
+{
+    if (!isOpen()) return create(filename);
+    flush();
+
+    // Edits made while the file was being saved are not in it
+    std::string tail(size > from ? size - from : 0, '\0');
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = in >= 0 && (tail.empty() || pread(in, &tail[0], tail.length(), from) == static_cast<ssize_t>(tail.length()));
+    if (in >= 0) ::close(in);
+    close(swapName(filename) != path);
+
+    if (!create(filename)) return false;
+    if (ok) buffer = tail;
+    return flush();
+}
+
+void Journal::close(bool remove)
+{
+    if (fd < 0) return;
+    flush();
+    ::close(fd);
+    fd = -1;
+    if (remove) unlink(path.c_str());
+    buffer.clear();
+}
+
+void Journal::begin(uint8_t op, uint32_t y)
+{
+    buffer += static_cast<char>(op);
+    put(y);
+}
+
+void Journal::put(uint64_t v)
+{
+    buffer.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void Journal::put(std::string_view s)
+{
+    put(s.length());
+    buffer += s;
+}
+
+void Journal::insertLines(uint32_t y, const std::vector<std::string_view> &lines)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::InsertLines), y);
+    put(lines.size());
+    for (std::string_view l : lines) put(l);
+}
+
+void Journal::insertLine(uint32_t y, std::string_view line)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::InsertLines), y);
+    put(1);
+    put(line);
+}
+
+void Journal::erase(uint32_t y, uint32_t cnt)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::Erase), y);
+    put(cnt);
+}
+
+void Journal::update(uint32_t y, std::string_view line)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::Update), y);
+    put(line);
+}
+
+void Journal::insertText(uint32_t y, uint64_t offset, std::string_view text)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::InsertText), y);
+    put(offset);
+    put(text);
+}
+
+void Journal::eraseText(uint32_t y, uint64_t offset, uint64_t cnt)
+{
+    if (!isOpen()) return;
+    begin(static_cast<uint8_t>(Op::EraseText), y);
+    put(offset);
+    put(cnt);
+}
+
+bool Journal::due() const
+{
+    if (buffer.empty()) return false;
+    return buffer.length() >= batchSize || std::chrono::steady_clock::now() - lastFlush >= flushInterval;
+}
+
+bool Journal::flush()
+{
+    lastFlush = std::chrono::steady_clock::now();
+    if (buffer.empty() || fd < 0) return fd >= 0;
+    bool ok = writeAll(fd, buffer.data(), buffer.length());
+    if (ok) size += buffer.length();
+    buffer.clear();
+    return ok;
+}
+
+uint64_t Journal::mark()
+{
+    flush();
+    return size;
+}
+
+bool Journal::replay(const std::string &filename, PieceTable &table, uint64_t &records)
+{
+    records = 0;
+    std::string swap = swapName(filename);
+    std::ifstream in(swap, std::ifstream::binary);
+    if (!in.is_open()) return false;
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string contents = ss.str();
+
+    uint64_t id[4];
+    fileIdentity(filename, id);
+    if (contents.length() < headerSize || memcmp(contents.data(), magic, sizeof(magic)) != 0) return false;
+    if (memcmp(contents.data() + sizeof(magic), id, sizeof(id)) != 0) return false;
+
+    Reader r(contents);
+    r.pos = headerSize;
+    uint64_t good = r.pos;
+    std::vector<std::string_view> lines;
+    while (r.pos < contents.length()) {
+        Op op = static_cast<Op>(contents[r.pos++]);
+        uint32_t y = r.get();
+        if (op == Op::InsertLines) {
+            uint64_t n = r.get();
+            lines.clear();
+            for (uint64_t i = 0; r.ok && i < n; ++i) lines.push_back(r.text());
+            if (r.ok) table.insert(y, lines);
+        } else if (op == Op::Erase) {
+            uint32_t cnt = r.get();
+            if (r.ok) table.erase(y, cnt);
+        } else if (op == Op::Update) {
+            std::string_view l = r.text();
+            if (r.ok) table.update(y, l);
+        } else if (op == Op::InsertText) {
+            uint64_t offset = r.get();
+            std::string_view text = r.text();
+            if (r.ok) {
+                GapBuffer &g = table.edit(y);
+                g.moveTo(offset);
+                g.insert(text);
+            }
+        } else if (op == Op::EraseText) {
+            uint64_t offset = r.get();
+            uint64_t cnt = r.get();
+            if (r.ok) {
+                GapBuffer &g = table.edit(y);
+                g.moveTo(offset);
+                g.eraseAfter(cnt);
+            }
+        } else {
+            r.ok = false;
+        }
+        // A record cut short by the crash ends the journal
+        if (!r.ok) break;
+        good = r.pos;
+        ++records;
+    }
+    table.commit();
+
+    if (good < contents.length() && truncate(swap.c_str(), good) != 0) return false;
+    return true;
+}
@@ -1,9 +1,12 @@
 #include "keyhandling.hh"
 #include "terminal.hh"
 #include "buffer.hh"
+#include "eventloop.hh"
 #include "tools.hh"
 
+#include <algorithm>
 #include <unistd.h>
+#include <cstdio>
 
 static const char KEY_NONE = 0x0;
 static const char KEY_CTRL_B = 0x2;
@@ -13,6 +16,7 @@ static const char KEY_ENTER = 0xA;
 static const char KEY_RETURN = 0xD;
 static const char KEY_ESC = 0x1b;
 static const char KEY_BACKSPACE = 0x7f;
+static const int BUSY_TICK_MS = 100;
 
 using editor::KeyHandling;
 
@@ -25,9 +29,22 @@ KeyHandling::KeyHandling() :
 char KeyHandling::readKey() const
 {
     char c = 0;
-    int cnt;
-    while ((cnt = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (cnt == -1 && errno != EAGAIN) Terminal::get()->die("Read failed");
+    Terminal *term = Terminal::get();
+    while (!term->takeInput(c)) {
+        // Saves and loads tick to show progress, journal records are
+        // written once typing pauses, otherwise there is nothing to wake for
+        Buffer *buf = Buffer::getCurrent();
+        bool busy = !writing.empty() || buf->loading() || Buffer::journalPending();
+        uint32_t events = EventLoop::get()->wait(busy ? BUSY_TICK_MS : -1);
+        if (events & EventLoop::Resize) term->resize();
+        if (events & EventLoop::Descriptor) Buffer::pollFileEvents();
+        if (events & EventLoop::Input) {
+            ssize_t cnt = term->readInput();
+            if (cnt > 0) continue;
+            if (term->closed()) return KEY_NONE;
+            if (cnt == -1 && errno != EAGAIN && errno != EINTR) term->die("Read failed");
+        }
+        return KEY_NONE;
     }
     return c;
 }
@@ -47,16 +64,68 @@ bool KeyHandling::isInsertMode() const
     return mode == Mode::InsertMode;
 }
 
-void KeyHandling::saveFile(std::string fname) const
+bool KeyHandling::saveFile(std::string fname)
 {
     if (!fname.empty()) {
-        if (editor::Buffer::getCurrent()->writeFile(fname)) {
-            Terminal::get()->setStatus("\"" + fname + "\" was written");
+        Buffer *buf = editor::Buffer::getCurrent();
+        if (buf->startWrite(fname)) {
+            writing.push_back(buf);
+            Terminal::get()->setStatus("Writing \"" + fname + "\"");
+            return true;
+        }
+        Terminal::get()->setError("Still writing \"" + buf->writingName() + "\"");
+    }
+    else Terminal::get()->setError("Invalid file name: " + stack);
+    return false;
+}
+
+void KeyHandling::checkWrites(bool wait)
+{
+    for (auto it = writing.begin(); it != writing.end();) {
+        Buffer *buf = *it;
+        std::string fname = buf->writingName();
+        if (!wait && !buf->writeDone()) {
+            Terminal::get()->setStatus("Writing \"" + fname + "\" " + std::to_string(buf->writeProgress()) + "%");
+            ++it;
+            continue;
+        }
+
+        if (buf->finishWrite()) {
+            double secs = buf->writeSeconds();
+            char rate[32];
+            snprintf(rate, sizeof(rate), "%.1f", secs > 0 ? buf->written() / secs / (1024 * 1024) : 0.0);
+            std::string lines = buf->sizeKnown() ? std::to_string(buf->size()) + "L, " : "";
+            Terminal::get()->setStatus("\"" + fname + "\" " + lines +
+                std::to_string(buf->written()) + "B written, " + rate + " MB/s");
         } else {
             Terminal::get()->setError("Could not write \"" + fname + "\"");
+            // Keeps the editor open so the changes are not lost
+            if (status == editor::Status::Quit) status = editor::Status::OK;
         }
+        it = writing.erase(it);
     }
-    else Terminal::get()->setError("Invalid file name: " + stack);
+}
+
+void KeyHandling::checkFile()
+{
+    Buffer *buf = Buffer::getCurrent();
+    if (buf->following()) {
+        buf->readAppended();
+        if (!buf->following()) Terminal::get()->setError("\"" + buf->filename() + "\" changed on disk, :reload to load it");
+    } else if (buf->changedOnDisk()) {
+        // Unsaved edits are not thrown away without asking
+        if (buf->modified()) Terminal::get()->setError("\"" + buf->filename() + "\" changed on disk, :reload to load it");
+        else reloadFile();
+    }
+}
+
+void KeyHandling::reloadFile()
+{
+    Buffer *buf = Buffer::getCurrent();
+    uint32_t changed;
+    if (buf->reload(changed)) {
+        Terminal::get()->setStatus("\"" + buf->filename() + "\" reloaded, " + std::to_string(changed) + " lines changed");
+    } else Terminal::get()->setError("Could not reload \"" + buf->filename() + "\"");
 }
 
 void KeyHandling::executeCommand()
@@ -66,19 +135,50 @@ void KeyHandling::executeCommand()
     } else if (substrSafe(stack, 0, 2) == "q!") {
         status = editor::Status::Quit;
     } else if (substrSafe(stack, 0, 2) == "w ") {
-        saveFile(editor::trim_copy(substrSafe(stack, 2)));
+        saveFile(editor::trim_copy(std::string(substrSafe(stack, 2))));
     } else if (substrSafe(stack, 0, 1) == "w") {
+        bool quit = substrSafe(stack, 1, 1) == "q";
         if (editor::Buffer::getCurrent()->hasFilename()) {
-            saveFile(editor::Buffer::getCurrent()->filename());
+            // A save still running holds older text, it is finished first
+            // so the one started here has everything
+            if (quit && editor::Buffer::getCurrent()->writing()) checkWrites(true);
+            if (saveFile(editor::Buffer::getCurrent()->filename()) && quit) status = editor::Status::Quit;
         } else Terminal::get()->setError("No file name");
-        if (substrSafe(stack, 1, 1) == "q") status = editor::Status::Quit;
     } else if (substrSafe(stack, 0, 3) == "vi ") {
-        std::string fname = editor::trim_copy(substrSafe(stack, 3));
-        if (!fname.empty()) Buffer::setCurrent(new Buffer(fname));
+        std::string fname = editor::trim_copy(std::string(substrSafe(stack, 3)));
+        if (!fname.empty()) {
+            Buffer *buf = new Buffer(fname);
+            Buffer::setCurrent(buf);
+            if (!buf->validUtf8()) Terminal::get()->setError("\"" + fname + "\" is not valid UTF-8");
+        }
+    } else if (stack == "reload" || stack == "e!") {
+        reloadFile();
     } else if (substrSafe(stack, 0, 2) == "bn" || substrSafe(stack, 0, 5) == "bnext") {
         Buffer::next();
     } else if (substrSafe(stack, 0, 2) == "bp" || substrSafe(stack, 0, 5) == "bprev") {
         Buffer::prev();
+    } else if (substrSafe(stack, 0, 4) == "set ") {
+        std::string opt = editor::trim_copy(std::string(substrSafe(stack, 4)));
+        if (opt == "fsync") Buffer::getCurrent()->setSyncOnSave(true);
+        else if (opt == "nofsync") Buffer::getCurrent()->setSyncOnSave(false);
+        else Terminal::get()->setError("Unknown option: " + opt);
+    } else if (substrSafe(stack, 0, 6) == "follow") {
+        std::string limit = editor::trim_copy(std::string(substrSafe(stack, 6)));
+        if (limit.length() > 9 || limit.find_first_not_of("0123456789") != std::string::npos) {
+            Terminal::get()->setError("Invalid line limit: " + limit);
+        } else if (Buffer::getCurrent()->follow(limit.empty() ? 0 : std::stoul(limit))) {
+            Buffer::getCurrent()->gotoY();
+        } else Terminal::get()->setError("Can not follow \"" + Buffer::getCurrent()->filename() + "\"");
+    } else if (substrSafe(stack, 0, 8) == "nofollow") {
+        Buffer::getCurrent()->unfollow();
+    } else if (substrSafe(stack, 0, 5) == "stats") {
+        Terminal *term = Terminal::get();
+        uint64_t refreshes = std::max<uint64_t>(term->refreshCount(), 1);
+        std::string stats = "Output: " + std::to_string(term->bytesWritten()) + "B in " +
+            std::to_string(term->refreshCount()) + " refreshes, " +
+            std::to_string(term->bytesWritten() / refreshes) + "B each";
+        if (editor::countingAllocations()) stats += ", allocations: " + std::to_string(editor::allocationCount());
+        term->setStatus(stats);
     } else Terminal::get()->setError("Unknown command: " + stack);
 }
 
@@ -167,16 +267,11 @@ void KeyHandling::handleDelete()
 void KeyHandling::handlePaste()
 {
     uint32_t cnt = parseMultiplier();
-    for (uint32_t c = 0; c < cnt; ++c) {
-        if (copyMode == CopyMode::Lines) {
-            for (auto s : copyBuffer) {
-                editor::Buffer::getCurrent()->insertLine(s);
-                editor::Buffer::getCurrent()->cursorDown();
-            }
-        } else {
-            editor::Buffer::getCurrent()->append(copyBufferChars);
-        }
+    if (copyMode == CopyMode::Lines) {
+        editor::Buffer::getCurrent()->insertLines(copyBuffer, cnt);
+        return;
     }
+    for (uint32_t c = 0; c < cnt; ++c) editor::Buffer::getCurrent()->append(copyBufferChars);
 }
 
 void KeyHandling::handleCommandEdit()
@@ -262,13 +357,49 @@ void KeyHandling::processNormalMode()
     }
 }
 
+void KeyHandling::pasteText(const std::string &text)
+{
+    // Goes into the command line as typed, without running it
+    if (isNormalMode() && operation == Operation::Command) {
+        for (char c : text) {
+            if (c == KEY_ENTER || c == KEY_RETURN || c == KEY_ESC) continue;
+            lastChar = c;
+            handleCommandEdit();
+        }
+        return;
+    }
+
+    // In normal mode it is inserted at the cursor like i, text and ESC
+    Buffer *buf = Buffer::getCurrent();
+    bool normal = isNormalMode();
+    if (normal) buf->undoAdd(UndoableAction(ActionScope::InsertMode, ActionType::Both));
+    if (utf8_valid(text)) {
+        buf->insertText(text);
+    } else {
+        // Invalid UTF-8 takes the key by key path, which drops what it can not use
+        for (char c : text) {
+            if (c == KEY_ESC) continue;
+            lastChar = c;
+            processInsertMode();
+        }
+    }
+    if (normal) {
+        buf->commitLine();
+        buf->undoApplyLine();
+        buf->sanitizePos();
+        buf->undoRecordPostPos();
+    }
+}
+
 void KeyHandling::processInsertMode()
 {
     if (lastChar == KEY_ESC) {
+        editor::Buffer::getCurrent()->commitLine();
         editor::Buffer::getCurrent()->undoApplyLine();
         editor::Buffer::getCurrent()->undoRecordPostPos();
         mode = Mode::NormalMode;
     } else if (lastChar == KEY_ENTER || lastChar == KEY_RETURN) {
+        editor::Buffer::getCurrent()->commitLine();
         editor::Buffer::getCurrent()->undoApplyLine();
         editor::Buffer::getCurrent()->insertLine("");
         editor::Buffer::getCurrent()->cursorDown();
@@ -288,10 +419,22 @@ editor::Status KeyHandling::processKeyPress()
 {
     status = editor::Status::OK;
     lastChar = readKey();
+    if (Terminal::get()->closed()) {
+        // Nobody is left to answer, saves are finished and the editor quits
+        checkWrites(true);
+        return editor::Status::Quit;
+    }
+    checkWrites(false);
+    Buffer::syncJournals(lastChar == KEY_NONE);
+    checkFile();
     if (lastChar == KEY_NONE) return status;
 
-    if (isNormalMode()) processNormalMode();
+    std::string pasted;
+    if (lastChar == KEY_ESC && Terminal::get()->takePaste(pasted)) pasteText(pasted);
+    else if (isNormalMode()) processNormalMode();
     else if (isInsertMode()) processInsertMode();
 
+    // Quitting waits for saves still running
+    if (status == editor::Status::Quit) checkWrites(true);
     return status;
 }
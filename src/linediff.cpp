@@ -0,0 +1,112 @@
+#include "linediff.hh"
+
+#include <algorithm>
+
+using editor::DiffHunk;
+
+std::vector<DiffHunk> editor::diffLines(uint32_t oldCount, const LineSource &oldLine,
+    uint32_t newCount, const LineSource &newLine, uint32_t maxEdits)
+{
+    std::vector<DiffHunk> res;
+    uint32_t pre = 0;
+    while (pre < oldCount && pre < newCount && oldLine(pre) == newLine(pre)) ++pre;
+    uint32_t suf = 0;
+    while (suf < oldCount - pre && suf < newCount - pre &&
+        oldLine(oldCount - 1 - suf) == newLine(newCount - 1 - suf)) ++suf;
+
+    int64_t n = oldCount - pre - suf;
+    int64_t m = newCount - pre - suf;
+    if (n == 0 && m == 0) return res;
+    if (n == 0 || m == 0) {
+        res.push_back(DiffHunk{pre, static_cast<uint32_t>(n), pre, static_cast<uint32_t>(m)});
+        return res;
+    }
+
+    std::hash<std::string_view> hash;
+    std::vector<uint64_t> a(n);
+    std::vector<uint64_t> b(m);
+    for (int64_t i = 0; i < n; ++i) a[i] = hash(oldLine(pre + i));
+    for (int64_t j = 0; j < m; ++j) b[j] = hash(newLine(pre + j));
+    // Hashes rule out most pairs, the text decides the rest so a
+    // collision never passes a changed line as unchanged
+    auto same = [&](int64_t i, int64_t j) {
+        return a[i] == b[j] && oldLine(pre + i) == newLine(pre + j);
+    };
+
+    // Myers' greedy search, keeping the furthest reaching x of every
+    // diagonal k for each number of edits d to walk back the path
+    int64_t limit = std::min<int64_t>(n + m, maxEdits);
+    std::vector<int64_t> v(2 * limit + 3, 0);
+    const int64_t mid = limit + 1;
+    std::vector<std::vector<int64_t>> trace;
+    int64_t found = -1;
+    for (int64_t d = 0; d <= limit && found < 0; ++d) {
+        for (int64_t k = -d; k <= d; k += 2) {
+            int64_t x;
+            if (k == -d || (k != d && v[mid + k - 1] < v[mid + k + 1])) x = v[mid + k + 1];
+            else x = v[mid + k - 1] + 1;
+            int64_t y = x - k;
+            while (x < n && y < m && same(x, y)) {
+                ++x;
+                ++y;
+            }
+            v[mid + k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+        trace.emplace_back(v.begin() + mid - d, v.begin() + mid + d + 1);
+    }
+    if (found < 0) {
+        res.push_back(DiffHunk{pre, static_cast<uint32_t>(n), pre, static_cast<uint32_t>(m)});
+        return res;
+    }
+
+    // Points each edit starts from, last edit first
+    struct Edit {
+        int64_t x;
+        int64_t y;
+        bool insert;
+    };
+    std::vector<Edit> edits;
+    int64_t x = n;
+    int64_t y = m;
+    for (int64_t d = found; d > 0; --d) {
+        const std::vector<int64_t> &prev = trace[d - 1];
+        int64_t k = x - y;
+        auto at = [&](int64_t kk) { return prev[kk + d - 1]; };
+        bool down = k == -d || (k != d && at(k - 1) < at(k + 1));
+        int64_t pk = down ? k + 1 : k - 1;
+        int64_t px = at(pk);
+        int64_t py = px - pk;
+        edits.push_back(Edit{px, py, down});
+        x = px;
+        y = py;
+    }
+
+    for (auto it = edits.rbegin(); it != edits.rend(); ++it) {
+        uint32_t ox = pre + it->x;
+        uint32_t ny = pre + it->y;
+        if (res.empty() || res.back().oldStart + res.back().oldCount != ox ||
+            res.back().newStart + res.back().newCount != ny) {
+            res.push_back(DiffHunk{ox, 0, ny, 0});
+        }
+        if (it->insert) ++res.back().newCount;
+        else ++res.back().oldCount;
+    }
+    return res;
+}
+
+uint32_t editor::mapLine(const std::vector<DiffHunk> &hunks, uint32_t y)
+{
+    for (auto it = hunks.rbegin(); it != hunks.rend(); ++it) {
+        if (y >= it->oldStart + it->oldCount) return y - it->oldStart - it->oldCount + it->newStart + it->newCount;
+        if (y >= it->oldStart) {
+            // Lands on the same spot in the replacement, or right after it
+            uint32_t off = y - it->oldStart;
+            return it->newStart + std::min(off, it->newCount);
+        }
+    }
+    return y;
+}
@@ -0,0 +1,99 @@
+#include "lineindexer.hh"
+#include "mappedfile.hh"
+#include "tools.hh"
+
+#include <cstring>
+
+using editor::LineIndexer;
+
+// Bytes scanned between handing lines over to the reader
+static const uint64_t chunkSize = 1024 * 1024;
+
+LineIndexer::LineIndexer() :
+    base(nullptr),
+    end(0),
+    pos(0),
+    valid(true),
+    done(true),
+    stopping(false)
+{
+}
+
+LineIndexer::~LineIndexer()
+{
+    stop();
+}
+
+void LineIndexer::start(const char *data, uint64_t from, uint64_t size)
+{
+    stop();
+    base = data;
+    end = size;
+    pos = from;
+    found.clear();
+    valid = true;
+    done = false;
+    stopping = false;
+    worker = std::thread(&LineIndexer::run, this);
+}
+
+void LineIndexer::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    if (worker.joinable()) worker.join();
+}
+
+void LineIndexer::run()
+{
+    std::vector<uint64_t> starts;
+    uint64_t p = pos;
+    while (p < end) {
+        uint64_t to = 0;
+        bool ok = true;
+        bool read = MappedFile::guard([&]() {
+            // Chunks end after a newline so no UTF-8 sequence is split
+            to = std::min(end, p + chunkSize);
+            const char *nl = static_cast<const char*>(memchr(base + to - 1, '\n', end - to + 1));
+            to = nl == nullptr ? end : nl - base + 1;
+
+            starts.clear();
+            const char *s = base + p;
+            while ((nl = static_cast<const char*>(memchr(s, '\n', base + to - s))) != nullptr) {
+                s = nl + 1;
+                starts.push_back(s - base);
+            }
+            ok = utf8_valid(base + p, base + to);
+        });
+        p = to;
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopping) return;
+        if (!read) {
+            // A mapped file shrank, what is left is up to the reader
+            stopping = true;
+            changed.notify_all();
+            return;
+        }
+        found.insert(found.end(), starts.begin(), starts.end());
+        if (!ok) valid = false;
+        pos = p;
+        changed.notify_all();
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+    changed.notify_all();
+}
+
+bool LineIndexer::take(std::vector<uint64_t> &starts, uint64_t want, bool &ok)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&]() { return done || stopping || found.size() >= want; });
+    starts.insert(starts.end(), found.begin(), found.end());
+    found.clear();
+    ok = valid;
+    return done;
+}
@@ -0,0 +1,93 @@
+#include "lineinfo.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using editor::LineInfo;
+
+LineInfo::LineInfo() :
+    cols(0),
+    tabSize(1)
+{
+}
+
+void LineInfo::update(std::string_view first, std::string_view second, uint32_t tabSize)
+{
+    this->tabSize = tabSize;
+    idx.build(first, second);
+    cols = idx.length();
+    tabPos.clear();
+    tabExtra.clear();
+    if (memchr(first.data(), '\t', first.length()) == nullptr &&
+        memchr(second.data(), '\t', second.length()) == nullptr) return;
+
+    uint32_t pos = 0;
+    for (std::string_view line : { first, second }) {
+        for (char c : line) {
+            // Continuation bytes do not start a codepoint
+            if ((c & 0xC0) == 0x80) continue;
+            if (c == '\t') tabPos.push_back(pos);
+            ++pos;
+        }
+    }
+    tabExtra.resize(tabPos.size());
+    measureTabs(0);
+}
+
+void LineInfo::insert(uint32_t pos, std::string_view::size_type offset, std::string_view text)
+{
+    uint32_t before = idx.length();
+    idx.insert(pos, offset, text);
+    uint32_t cnt = idx.length() - before;
+
+    uint32_t first = tabsBefore(pos);
+    for (uint32_t i = first; i < tabPos.size(); ++i) tabPos[i] += cnt;
+    if (memchr(text.data(), '\t', text.length()) != nullptr) {
+        std::vector<uint32_t> added;
+        uint32_t p = pos;
+        for (char c : text) {
+            if ((c & 0xC0) == 0x80) continue;
+            if (c == '\t') added.push_back(p);
+            ++p;
+        }
+        tabPos.insert(tabPos.begin() + first, added.begin(), added.end());
+        tabExtra.resize(tabPos.size());
+    }
+    measureTabs(first);
+}
+
+void LineInfo::erase(uint32_t pos, std::string_view::size_type offset, uint32_t cnt, std::string_view::size_type bytes)
+{
+    idx.erase(pos, offset, cnt, bytes);
+
+    uint32_t first = tabsBefore(pos);
+    uint32_t last = tabsBefore(pos + cnt);
+    tabPos.erase(tabPos.begin() + first, tabPos.begin() + last);
+    tabExtra.resize(tabPos.size());
+    for (uint32_t i = first; i < tabPos.size(); ++i) tabPos[i] -= cnt;
+    measureTabs(first);
+}
+
+void LineInfo::measureTabs(uint32_t from)
+{
+    // Padding of a tab depends on the column it lands on, so every
+    // tab from the first one that moved is measured again
+    uint32_t extra = from == 0 ? 0 : tabExtra[from - 1];
+    for (uint32_t i = from; i < tabPos.size(); ++i) {
+        uint32_t col = tabPos[i] + extra;
+        extra += (tabSize - (col + 1) % tabSize) % tabSize;
+        tabExtra[i] = extra;
+    }
+    cols = idx.length() + extra;
+}
+
+uint32_t LineInfo::tabsBefore(uint32_t pos) const
+{
+    return std::lower_bound(tabPos.begin(), tabPos.end(), pos) - tabPos.begin();
+}
+
+uint32_t LineInfo::tabExtraBefore(uint32_t pos) const
+{
+    uint32_t cnt = tabsBefore(pos);
+    return cnt == 0 ? 0 : tabExtra[cnt - 1];
+}
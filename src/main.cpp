@@ -3,14 +3,46 @@
 #include "buffer.hh"
 #include "undo.hh"
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <clocale>
+#include <langinfo.h>
+
+// Longest a batch of pending input may hold back the next frame
+static const std::chrono::milliseconds frameInterval(33);
 
 int main(int argc, char **argv)
 {
     std::string src;
-    if (argc > 1) src = argv[1];
+    bool recover = false;
+    bool follow = false;
+    uint32_t limit = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-r") == 0) recover = true;
+        else if (strcmp(argv[i], "-F") == 0) follow = true;
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) limit = strtoul(argv[++i], nullptr, 10);
+        else src = argv[i];
+    }
+    // Widths of characters come from the locale, the text is always UTF-8
+    if (setlocale(LC_CTYPE, "") == nullptr || strcmp(nl_langinfo(CODESET), "UTF-8") != 0) setlocale(LC_CTYPE, "C.UTF-8");
     editor::Buffer buffer(src);
     editor::Terminal *term = editor::Terminal::get();
     editor::KeyHandling keyHandling;
+    if (!buffer.validUtf8()) term->setError("\"" + src + "\" is not valid UTF-8");
+
+    if (recover) {
+        uint64_t records;
+        if (!buffer.hasSwap()) term->setError("No swap file for \"" + src + "\"");
+        else if (buffer.recover(records)) term->setStatus("Recovered " + std::to_string(records) + " changes to \"" + src + "\"");
+        else term->setError("Could not recover \"" + src + "\", the file changed since");
+    } else if (buffer.hasSwap()) {
+        term->setError("Swap file " + editor::Journal::swapName(src) + " exists, start with -r to recover");
+    }
+    if (follow) {
+        if (buffer.follow(limit)) buffer.gotoY();
+        else term->setError("Can not follow \"" + src + "\"");
+    }
 
     term->enableRawMode();
     term->clearScreen();
@@ -18,8 +50,16 @@ int main(int argc, char **argv)
     editor::Status status = editor::Status::OK;
     while (status == editor::Status::OK) {
         term->refresh();
-        status = keyHandling.processKeyPress();
+        // Keys already waiting are handled before the next frame,
+        // so pastes and key repeat do not redraw for every byte
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + frameInterval;
+        do {
+            status = keyHandling.processKeyPress();
+        } while (status == editor::Status::OK && term->inputPending() && std::chrono::steady_clock::now() < deadline);
     }
+    // Buffers opened with :vi are never deleted, their swap files go here.
+    // They are kept for recovery when the terminal went away.
+    editor::Buffer::closeJournals(!term->closed());
     term->clearScreen();
     term->flush();
 
@@ -0,0 +1,102 @@
+#include "mappedfile.hh"
+
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using editor::MappedFile;
+
+static thread_local sigjmp_buf *guarded = nullptr;
+
+static void onBusError(int sig)
+{
+    if (guarded != nullptr) siglongjmp(*guarded, 1);
+    // Not a guarded read, the fault happens again and ends the editor
+    signal(sig, SIG_DFL);
+}
+
+MappedFile::MappedFile() :
+    fd(-1),
+    base(nullptr),
+    length(0),
+    info()
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+    fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode)) {
+        close();
+        return false;
+    }
+    length = info.st_size;
+    if (length == 0) return true;
+
+    void *m = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+        close();
+        return false;
+    }
+    base = static_cast<const char*>(m);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (base != nullptr) munmap(const_cast<char*>(base), length);
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    base = nullptr;
+    length = 0;
+}
+
+uint64_t MappedFile::fileSize() const
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1) return length;
+    return st.st_size;
+}
+
+bool MappedFile::guard(const std::function<void()> &fn)
+{
+    static std::once_flag installed;
+    std::call_once(installed, []() {
+        struct sigaction sa = {};
+        sa.sa_handler = onBusError;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, nullptr);
+    });
+
+    sigjmp_buf jump;
+    sigjmp_buf *outer = guarded;
+    // The mask is restored too, the handler runs with SIGBUS blocked
+    if (sigsetjmp(jump, 1) != 0) {
+        guarded = outer;
+        return false;
+    }
+    guarded = &jump;
+    fn();
+    guarded = outer;
+    return true;
+}
+
+bool MappedFile::sameFile(const std::string &filename) const
+{
+    if (!isOpen()) return false;
+    struct stat st;
+    if (stat(filename.c_str(), &st) == -1) return false;
+    return st.st_dev == info.st_dev && st.st_ino == info.st_ino;
+}
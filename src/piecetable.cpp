@@ -0,0 +1,580 @@
+#include "piecetable.hh"
+#include "tools.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using editor::PieceTable;
+
+// Lines indexed at once when more of the original is needed
+static const uint32_t indexBatch = 4096;
+// Smallest part of the file worth giving to a worker thread
+static const uint64_t parallelChunk = 4 * 1024 * 1024;
+
+static bool scanLines(const char *base, uint64_t from, uint64_t to, std::vector<uint64_t> &starts)
+{
+    const char *p = base + from;
+    const char *end = base + to;
+    while (p < end) {
+        const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (nl == nullptr) break;
+        p = nl + 1;
+        starts.push_back(p - base);
+    }
+    return editor::utf8_valid(base + from, end);
+}
+
+PieceTable::PieceTable() :
+    originalData(nullptr),
+    originalSize(0),
+    root(nil),
+    seed(2463534242u),
+    editNode(nil),
+    lines(0),
+    scanPos(0),
+    indexed(true),
+    utf8Valid(true),
+    rev(0)
+{
+    clear();
+}
+
+void PieceTable::clear()
+{
+    loader.stop();
+    cache.close();
+    original.reset();
+    mapped.reset();
+    originalData = "";
+    originalSize = 0;
+    added.clear();
+    freeSlots.clear();
+    editing.clear();
+    originalStarts.assign(1, 0);
+    nodes.clear();
+    freeNodes.clear();
+    root = nil;
+    editNode = nil;
+    lines = 0;
+    scanPos = 0;
+    indexed = true;
+    utf8Valid = true;
+    ++rev;
+}
+
+void PieceTable::load(std::string contents)
+{
+    clear();
+    original = std::make_shared<const std::string>(std::move(contents));
+    originalData = original->data();
+    originalSize = original->size();
+    indexed = false;
+}
+
+bool PieceTable::map(const std::string &filename)
+{
+    clear();
+    std::shared_ptr<MappedFile> m = std::make_shared<MappedFile>();
+    if (!m->open(filename)) return false;
+    mapped = m;
+    originalData = mapped->data();
+    originalSize = mapped->size();
+    indexed = false;
+
+    if (cache.open(mapped->descriptor(), filename) && cache.starts()[cache.count() - 1] - originalSize <= 1) {
+        lines = cache.count() - 1;
+        utf8Valid = cache.validUtf8();
+        scanPos = originalSize;
+        indexed = true;
+        root = append(root, Piece{Source::Original, 0, lines});
+        return true;
+    }
+    cache.close();
+    loader.start(originalData, 0, originalSize);
+    return true;
+}
+
+bool PieceTable::unmapShrunk()
+{
+    if (!mapped) return false;
+    uint64_t keep = mapped->fileSize();
+    if (keep >= originalSize) return false;
+
+    // Whatever the background scan had not handed over yet is scanned
+    // again from the copy, or lost with the rest of the file
+    loader.stop();
+    if (cache.starts()) {
+        originalStarts.assign(cache.starts(), cache.starts() + cache.count());
+        cache.close();
+    }
+
+    // The file can shrink again while it is copied, then the copy stops
+    // at the new end. When reading faults though the file did not
+    // shrink, nothing of it can be read.
+    std::string copy(keep, 0);
+    while (!MappedFile::guard([&]() { memcpy(&copy[0], originalData, keep); })) {
+        uint64_t now = mapped->fileSize();
+        keep = now < keep ? now : 0;
+        copy.resize(keep);
+    }
+    if (keep >= scanPos) {
+        originalSize = keep;
+    } else {
+        // Line cut by the new end keeps its start, later ones become
+        // empty so the pieces referring to them stay valid
+        uint32_t last = originalStarts.size() - 1;
+        uint32_t cut = std::upper_bound(originalStarts.begin(), originalStarts.end(), keep + 1) - originalStarts.begin() - 1;
+        if (originalStarts[cut] > keep) copy += '\n';
+        for (uint32_t l = cut + 1; l <= last; ++l) {
+            copy += '\n';
+            originalStarts[l] = copy.size();
+        }
+        originalSize = copy.size();
+        scanPos = originalSize;
+        indexed = true;
+    }
+    original = std::make_shared<const std::string>(std::move(copy));
+    originalData = original->data();
+    mapped.reset();
+    ++rev;
+    return true;
+}
+
+std::shared_ptr<const void> PieceTable::originalStorage() const
+{
+    if (mapped) return mapped;
+    return original;
+}
+
+void PieceTable::indexTo(uint32_t y) const
+{
+    if (indexed || y < lines) return;
+
+    uint32_t first = originalStarts.size() - 1;
+    if (y == UINT32_MAX) {
+        // All cores get through the rest faster than the background scan
+        if (loader.running()) {
+            loader.stop();
+            takeLoaded(0);
+        }
+        indexRest();
+    } else if (loader.running()) {
+        uint32_t target = y > UINT32_MAX - indexBatch ? UINT32_MAX : y + indexBatch;
+        takeLoaded(target - lines + 1);
+    } else {
+        uint32_t target = y > UINT32_MAX - indexBatch ? UINT32_MAX : y + indexBatch;
+        uint64_t from = scanPos;
+        const char *end = originalData + originalSize;
+        const char *p = originalData + scanPos;
+        while (p < end && lines + (originalStarts.size() - 1 - first) <= target) {
+            const char *nl = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (nl == nullptr) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            originalStarts.push_back(p - originalData);
+        }
+        scanPos = p - originalData;
+        if (!editor::utf8_valid(originalData + from, p)) utf8Valid = false;
+    }
+    addIndexed(first);
+}
+
+void PieceTable::takeLoaded(uint64_t want) const
+{
+    bool valid;
+    bool finished = loader.take(originalStarts, want, valid);
+    if (!valid) utf8Valid = false;
+    scanPos = finished ? originalSize : originalStarts.back();
+    if (finished) loader.stop();
+}
+
+void PieceTable::addIndexed(uint32_t first) const
+{
+    uint32_t cnt = originalStarts.size() - 1 - first;
+
+    if (scanPos >= originalSize) {
+        indexed = true;
+        // Last line without newline gets a virtual one so every line is [start, next - 1)
+        if (originalStarts.back() != originalSize) {
+            originalStarts.push_back(originalSize + 1);
+            ++cnt;
+        }
+        if (mapped) cache.store(originalStarts, utf8Valid);
+    }
+    if (cnt == 0) return;
+
+    lines += cnt;
+    root = append(root, Piece{Source::Original, first, cnt});
+}
+
+uint32_t PieceTable::loadPercent() const
+{
+    if (loader.running()) {
+        uint32_t first = originalStarts.size() - 1;
+        takeLoaded(0);
+        addIndexed(first);
+    }
+    if (indexed || originalSize == 0) return 100;
+    return scanPos * 100 / originalSize;
+}
+
+void PieceTable::indexRest() const
+{
+    uint64_t from = scanPos;
+    uint64_t jobs = std::min<uint64_t>(workerCount(), (originalSize - from) / parallelChunk);
+    if (jobs == 0) jobs = 1;
+
+    // Chunks end right after a newline so no line or UTF-8 sequence is split
+    std::vector<uint64_t> bounds(jobs + 1, originalSize);
+    bounds[0] = from;
+    for (uint64_t j = 1; j < jobs; ++j) {
+        uint64_t b = std::max(bounds[j - 1], from + (originalSize - from) * j / jobs);
+        const char *nl = static_cast<const char*>(memchr(originalData + b, '\n', originalSize - b));
+        bounds[j] = nl == nullptr ? originalSize : nl - originalData + 1;
+    }
+
+    std::vector<std::vector<uint64_t>> found(jobs);
+    std::vector<char> valid(jobs);
+    parallel(jobs, [&](uint32_t j) {
+        valid[j] = scanLines(originalData, bounds[j], bounds[j + 1], found[j]);
+    });
+
+    size_t total = originalStarts.size();
+    for (const std::vector<uint64_t> &f : found) total += f.size();
+    originalStarts.reserve(total + 1);
+    for (uint64_t j = 0; j < jobs; ++j) {
+        originalStarts.insert(originalStarts.end(), found[j].begin(), found[j].end());
+        if (!valid[j]) utf8Valid = false;
+    }
+    scanPos = originalSize;
+}
+
+std::string_view PieceTable::line(uint32_t y) const
+{
+    indexTo(y);
+    uint32_t offset;
+    uint32_t n = locate(y, offset);
+    if (n == nil) return "";
+    return text(nodes[n].piece, offset);
+}
+
+void PieceTable::line(uint32_t y, std::string_view &first, std::string_view &second) const
+{
+    indexTo(y);
+    uint32_t offset;
+    uint32_t n = locate(y, offset);
+    second = "";
+    if (n == nil) first = "";
+    else if (nodes[n].piece.source != Source::Editing) first = text(nodes[n].piece, offset);
+    else {
+        first = editing.before();
+        second = editing.after();
+    }
+}
+
+std::string_view PieceTable::text(const Piece &piece, uint32_t offset) const
+{
+    uint32_t l = piece.first + offset;
+    if (piece.source == Source::Added) return added[l];
+    if (piece.source == Source::Editing) return editing.view();
+    uint64_t start = lineStart(l);
+    return std::string_view(originalData + start, lineStart(l + 1) - start - 1);
+}
+
+uint32_t PieceTable::addLine(std::string_view line)
+{
+    if (freeSlots.empty()) {
+        added.emplace_back(line);
+        return added.size() - 1;
+    }
+    uint32_t res = freeSlots.back();
+    freeSlots.pop_back();
+    added[res].assign(line.data(), line.length());
+    return res;
+}
+
+void PieceTable::releaseLines(const Piece &piece)
+{
+    if (piece.source != Source::Added) return;
+    for (uint32_t l = piece.first; l < piece.first + piece.count; ++l) {
+        std::string().swap(added[l]);
+        freeSlots.push_back(l);
+    }
+}
+
+uint32_t PieceTable::newNode(const Piece &piece) const
+{
+    // xorshift32, the priorities only need to be spread out
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    Node node{piece, piece.count, seed, nil, nil};
+
+    if (freeNodes.empty()) {
+        nodes.push_back(node);
+        return nodes.size() - 1;
+    }
+    uint32_t res = freeNodes.back();
+    freeNodes.pop_back();
+    nodes[res] = node;
+    return res;
+}
+
+void PieceTable::release(uint32_t n)
+{
+    if (n == nil) return;
+    release(nodes[n].left);
+    release(nodes[n].right);
+    releaseLines(nodes[n].piece);
+    if (n == editNode) editNode = nil;
+    freeNodes.push_back(n);
+}
+
+void PieceTable::pull(uint32_t n) const
+{
+    Node &node = nodes[n];
+    node.lines = node.piece.count + total(node.left) + total(node.right);
+}
+
+uint32_t PieceTable::merge(uint32_t a, uint32_t b) const
+{
+    if (a == nil) return b;
+    if (b == nil) return a;
+    if (nodes[a].priority > nodes[b].priority) {
+        uint32_t r = merge(nodes[a].right, b);
+        nodes[a].right = r;
+        pull(a);
+        return a;
+    }
+    uint32_t l = merge(a, nodes[b].left);
+    nodes[b].left = l;
+    pull(b);
+    return b;
+}
+
+void PieceTable::splitAt(uint32_t n, uint32_t y, uint32_t &a, uint32_t &b) const
+{
+    if (n == nil) {
+        a = b = nil;
+        return;
+    }
+
+    uint32_t before = total(nodes[n].left);
+    uint32_t count = nodes[n].piece.count;
+    if (y <= before) {
+        uint32_t l;
+        splitAt(nodes[n].left, y, a, l);
+        nodes[n].left = l;
+        pull(n);
+        b = n;
+    } else if (y >= before + count) {
+        uint32_t r;
+        splitAt(nodes[n].right, y - before - count, r, b);
+        nodes[n].right = r;
+        pull(n);
+        a = n;
+    } else {
+        // Split point is inside this piece, the tail becomes a node of its own
+        Piece tail = nodes[n].piece;
+        tail.first += y - before;
+        tail.count -= y - before;
+        nodes[n].piece.count = y - before;
+        uint32_t right = nodes[n].right;
+        nodes[n].right = nil;
+        pull(n);
+        a = n;
+        b = merge(newNode(tail), right);
+    }
+}
+
+uint32_t PieceTable::append(uint32_t n, const Piece &piece) const
+{
+    uint32_t last = n;
+    while (last != nil && nodes[last].right != nil) last = nodes[last].right;
+
+    // Consecutive lines of the same source, for example typed ones, extend the last piece
+    if (last != nil) {
+        Piece &prev = nodes[last].piece;
+        if (prev.source == piece.source && piece.source != Source::Editing &&
+                prev.first + prev.count == piece.first) {
+            prev.count += piece.count;
+            for (uint32_t m = n; m != nil; m = nodes[m].right) nodes[m].lines += piece.count;
+            return n;
+        }
+    }
+    return merge(n, newNode(piece));
+}
+
+uint32_t PieceTable::locate(uint32_t y, uint32_t &offset) const
+{
+    uint32_t n = root;
+    while (n != nil) {
+        const Node &node = nodes[n];
+        uint32_t before = total(node.left);
+        if (y < before) {
+            n = node.left;
+        } else if (y < before + node.piece.count) {
+            offset = y - before;
+            return n;
+        } else {
+            y -= before + node.piece.count;
+            n = node.right;
+        }
+    }
+    offset = 0;
+    return nil;
+}
+
+bool PieceTable::forEachBlock(const std::function<bool(std::string_view, bool)> &fn) const
+{
+    if (!visit(root, fn)) return false;
+    if (indexed) return true;
+
+    // Part of the original not indexed yet goes out as is
+    const char *from = originalData + scanPos;
+    const char *end = originalData + originalSize;
+    const char *nl = static_cast<const char*>(memrchr(from, '\n', end - from));
+    const char *last = nl == nullptr ? from : nl + 1;
+    if (last > from && !fn(std::string_view(from, last - from), true)) return false;
+    return last == end || fn(std::string_view(last, end - last), false);
+}
+
+bool PieceTable::visit(uint32_t n, const std::function<bool(std::string_view, bool)> &fn) const
+{
+    if (n == nil) return true;
+    if (!visit(nodes[n].left, fn)) return false;
+
+    const Piece &piece = nodes[n].piece;
+    if (piece.source == Source::Original) {
+        uint64_t from = lineStart(piece.first);
+        uint32_t whole = piece.count;
+        // Last line of a file without a trailing newline has none to borrow
+        if (lineStart(piece.first + whole) > originalSize) --whole;
+        if (whole > 0 && !fn(std::string_view(originalData + from, lineStart(piece.first + whole) - from), true)) return false;
+        if (whole < piece.count && !fn(text(piece, whole), false)) return false;
+    } else {
+        for (uint32_t l = 0; l < piece.count; ++l) {
+            if (!fn(text(piece, l), false)) return false;
+        }
+    }
+    return visit(nodes[n].right, fn);
+}
+
+void PieceTable::commit()
+{
+    if (editNode == nil) return;
+    nodes[editNode].piece = Piece{Source::Added, addLine(editing.view()), 1};
+    editNode = nil;
+    ++rev;
+}
+
+editor::GapBuffer &PieceTable::edit(uint32_t y)
+{
+    if (!has(y)) {
+        // Nothing to edit, hand out a detached buffer
+        commit();
+        editing.clear();
+        return editing;
+    }
+
+    uint32_t offset;
+    if (locate(y, offset) == editNode) return editing;
+
+    commit();
+    uint32_t a, b, c;
+    splitAt(root, y, a, b);
+    splitAt(b, 1, b, c);
+    // Assigning reuses the capacity of the previous line being edited
+    editing.assign(text(nodes[b].piece, 0));
+    releaseLines(nodes[b].piece);
+    nodes[b].piece = Piece{Source::Editing, 0, 1};
+    editNode = b;
+    root = merge(merge(a, b), c);
+    ++rev;
+    return editing;
+}
+
+void PieceTable::insert(uint32_t y, std::string_view line)
+{
+    indexTo(y);
+    if (y > lines) y = lines;
+
+    uint32_t a, b;
+    splitAt(root, y, a, b);
+    a = append(a, Piece{Source::Added, addLine(line), 1});
+    root = merge(a, b);
+    ++lines;
+    ++rev;
+}
+
+void PieceTable::insert(uint32_t y, const std::vector<std::string_view> &text)
+{
+    if (text.empty()) return;
+    indexTo(y);
+    if (y > lines) y = lines;
+
+    // Freed slots are used first so lines that come and go, as when
+    // following a file with a limit, do not grow added. Sorted, they
+    // mostly form runs, and each run becomes one piece.
+    size_t reused = std::min(text.size(), freeSlots.size());
+    std::vector<uint32_t> slots(freeSlots.end() - reused, freeSlots.end());
+    freeSlots.resize(freeSlots.size() - reused);
+    std::sort(slots.begin(), slots.end());
+    uint32_t fresh = added.size();
+    for (size_t i = reused; i < text.size(); ++i) slots.push_back(fresh++);
+    added.resize(fresh);
+
+    uint32_t a, b;
+    splitAt(root, y, a, b);
+    for (size_t i = 0; i < slots.size();) {
+        size_t j = i + 1;
+        while (j < slots.size() && slots[j] == slots[j - 1] + 1) ++j;
+        for (size_t k = i; k < j; ++k) added[slots[k]].assign(text[k].data(), text[k].length());
+        a = append(a, Piece{Source::Added, slots[i], static_cast<uint32_t>(j - i)});
+        i = j;
+    }
+    root = merge(a, b);
+    lines += text.size();
+    ++rev;
+}
+
+void PieceTable::update(uint32_t y, std::string_view line)
+{
+    if (!has(y)) return;
+    uint32_t offset;
+    uint32_t n = locate(y, offset);
+    const Piece &piece = nodes[n].piece;
+    if (piece.source == Source::Added) {
+        added[piece.first + offset].assign(line.data(), line.length());
+        ++rev;
+        return;
+    }
+
+    // Copied before the old line is erased, line may be a view of it
+    uint32_t slot = addLine(line);
+    erase(y, 1);
+    uint32_t a, b;
+    splitAt(root, y, a, b);
+    a = append(a, Piece{Source::Added, slot, 1});
+    root = merge(a, b);
+    ++lines;
+    ++rev;
+}
+
+void PieceTable::erase(uint32_t y, uint32_t cnt)
+{
+    if (cnt == 0) return;
+    indexTo(cnt > UINT32_MAX - y ? UINT32_MAX : y + cnt - 1);
+    if (y >= lines) return;
+    if (cnt > lines - y) cnt = lines - y;
+
+    uint32_t a, b, c;
+    splitAt(root, y, a, b);
+    splitAt(b, cnt, b, c);
+    release(b);
+    root = merge(a, c);
+    lines -= cnt;
+    ++rev;
+}
@@ -0,0 +1,104 @@
+#include "savejob.hh"
+#include "filewriter.hh"
+#include "eventloop.hh"
+
+#include <chrono>
+
+using editor::SaveJob;
+using editor::EventLoop;
+
+SaveJob::SaveJob() :
+    total(0),
+    originalData(nullptr),
+    originalSize(0),
+    originalFd(-1),
+    originalStatus(),
+    written(0),
+    finished(false),
+    result(false),
+    elapsed(0)
+{
+}
+
+SaveJob::~SaveJob()
+{
+    if (worker.joinable()) worker.join();
+}
+
+void SaveJob::setOriginal(std::shared_ptr<const void> s, const char *data, uint64_t size, int fd, const struct stat *status)
+{
+    storage = s;
+    originalData = data;
+    originalSize = size;
+    originalFd = fd;
+    if (status != nullptr) originalStatus = *status;
+}
+
+void SaveJob::addOriginal(std::string_view text)
+{
+    if (text.empty()) return;
+    blocks.push_back(Block{true, static_cast<uint64_t>(text.data() - originalData), text.length()});
+    total += text.length();
+}
+
+void SaveJob::addCopy(std::string_view text)
+{
+    if (text.empty()) return;
+    // Copies always follow each other, so consecutive ones become one block
+    if (!blocks.empty() && !blocks.back().original) blocks.back().length += text.length();
+    else blocks.push_back(Block{false, copied.length(), text.length()});
+    copied += text;
+    total += text.length();
+}
+
+bool SaveJob::sameLayout() const
+{
+    if (total != originalSize) return false;
+    uint64_t pos = 0;
+    for (const Block &b : blocks) {
+        if (b.original && b.offset != pos) return false;
+        pos += b.length;
+    }
+    return true;
+}
+
+bool SaveJob::run(const std::string &filename, bool inPlace, bool sync)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    FileWriter out;
+    inPlace = inPlace && originalFd >= 0 && out.openInPlace(filename, originalStatus);
+    bool ok = inPlace || out.open(filename);
+
+    for (size_t i = 0; ok && i < blocks.size(); ++i) {
+        const Block &b = blocks[i];
+        if (!b.original) {
+            ok = out.write(std::string_view(copied.data() + b.offset, b.length));
+        } else if (inPlace) {
+            ok = out.skip(b.length);
+        } else {
+            ok = out.copy(originalFd, b.offset, std::string_view(originalData + b.offset, b.length));
+        }
+        written = out.size();
+    }
+    ok = ok && out.commit(sync);
+
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result = ok;
+    finished = true;
+    return ok;
+}
+
+void SaveJob::start(const std::string &filename, bool inPlace, bool sync)
+{
+    worker = std::thread([this, filename, inPlace, sync]() {
+        run(filename, inPlace, sync);
+        // The editor picks up the result without waiting for a key
+        EventLoop::wake();
+    });
+}
+
+bool SaveJob::wait()
+{
+    if (worker.joinable()) worker.join();
+    return result;
+}
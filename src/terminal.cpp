@@ -1,7 +1,11 @@
 #include "terminal.hh"
 #include "buffer.hh"
+#include "tools.hh"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
@@ -17,6 +21,23 @@ static const std::string CMD_CURSOR_TOPLEFT = ESCAPE_KEY "[H";
 static const std::string CMD_CURSOR_HIDE = ESCAPE_KEY "[?25l";
 static const std::string CMD_CURSOR_SHOW = ESCAPE_KEY "[?25h";
 static const std::string CMD_REMOVE_TILL_END = ESCAPE_KEY "[K";
+static const std::string CMD_SYNC_BEGIN = ESCAPE_KEY "[?2026h";
+static const std::string CMD_SYNC_END = ESCAPE_KEY "[?2026l";
+static const std::string CMD_RESET_SCROLL_REGION = ESCAPE_KEY "[r";
+// Asks for the state of synchronized output, then for the device
+// attributes every terminal answers, so there is no need to wait long
+static const std::string CMD_QUERY_SYNC = ESCAPE_KEY "[?2026$p" ESCAPE_KEY "[c";
+static const int QUERY_TIMEOUT_MS = 500;
+// Pastes come wrapped in markers instead of looking like typing
+static const std::string CMD_PASTE_ON = ESCAPE_KEY "[?2004h";
+static const std::string CMD_PASTE_OFF = ESCAPE_KEY "[?2004l";
+static const std::string PASTE_BEGIN = "[200~";
+static const std::string PASTE_END = ESCAPE_KEY "[201~";
+// A lone ESC is not held up for longer than this
+static const int ESCAPE_TIMEOUT_MS = 50;
+static const int PASTE_TIMEOUT_MS = 1000;
+// Cells with more bytes than fit in them, forgotten when there are this many
+static const size_t MAX_CLUSTERS = 4096;
 
 static const std::string NEWLINE = "\r\n";
 static const int  STATUS_DEFAULT_TIME = 5;
@@ -34,7 +55,16 @@ Terminal* Terminal::get()
 Terminal::Terminal() :
     width(80),
     height(24),
-    statusTime(0)
+    statusTime(0),
+    cursorX(-1),
+    cursorY(-1),
+    screenBuffer(nullptr),
+    screenRow(0),
+    bytesOut(0),
+    refreshes(0),
+    syncOutput(false),
+    inputPos(0),
+    inputClosed(false)
 {
     getWindowSize();
 }
@@ -59,6 +89,111 @@ void Terminal::enableRawMode()
     setTimeout();
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("Can't set terminal attributes");
+    syncOutput = detectSyncOutput();
+    output(CMD_PASTE_ON);
+}
+
+bool Terminal::detectSyncOutput()
+{
+    const char *env = getenv("MIV_SYNC");
+    if (env != nullptr) return env[0] == '1';
+    if (!isatty(STDOUT_FILENO)) return false;
+
+    output(CMD_QUERY_SYNC);
+    std::string reply;
+    int state = 0;
+    bool answered = false;
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    for (int waited = 0; !answered && waited < QUERY_TIMEOUT_MS;) {
+        if (poll(&pfd, 1, 10) <= 0) {
+            waited += 10;
+            continue;
+        }
+        char buf[64];
+        ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+        if (len > 0) reply.append(buf, len);
+
+        // Complete answers are taken off the front, keys pressed
+        // meanwhile are kept for readKey()
+        while (!reply.empty()) {
+            if (reply.compare(0, 3, ESCAPE_KEY "[?") != 0) {
+                if (reply[0] == ESCAPE_KEY[0] && reply.length() < 3) break;
+                input += reply[0];
+                reply.erase(0, 1);
+                continue;
+            }
+            std::string::size_type end = reply.find_first_of("cy", 3);
+            if (end == std::string::npos) break;
+            if (reply[end] == 'c') answered = true;
+            else if (reply.compare(3, 5, "2026;") == 0 && end > 8) state = reply[8] - '0';
+            reply.erase(0, end + 1);
+        }
+    }
+    input += reply;
+    // 1 and 2 are set and reset, 0 and 4 mean it can not be used
+    return state == 1 || state == 2;
+}
+
+bool Terminal::takeInput(char &c)
+{
+    if (inputPos == input.length()) return false;
+    c = input[inputPos++];
+    if (inputPos == input.length()) {
+        input.clear();
+        inputPos = 0;
+    }
+    return true;
+}
+
+ssize_t Terminal::readInput()
+{
+    char buf[4096];
+    ssize_t cnt = read(STDIN_FILENO, buf, sizeof(buf));
+    if (cnt > 0) input.append(buf, cnt);
+    // Only called once poll saw input, so nothing to read is a hangup
+    else if (cnt == 0 || errno == EIO) inputClosed = true;
+    return cnt;
+}
+
+bool Terminal::waitInput(int timeoutMs)
+{
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, timeoutMs) > 0 && readInput() > 0;
+}
+
+bool Terminal::takePaste(std::string &text)
+{
+    // The start marker may still be on its way when the ESC was read
+    std::string_view pending = std::string_view(input).substr(inputPos);
+    while (!pending.empty() && pending.length() < PASTE_BEGIN.length() &&
+        PASTE_BEGIN.compare(0, pending.length(), pending) == 0 && waitInput(ESCAPE_TIMEOUT_MS)) {
+        pending = std::string_view(input).substr(inputPos);
+    }
+    if (pending.compare(0, PASTE_BEGIN.length(), PASTE_BEGIN) != 0) return false;
+
+    std::string::size_type begin = inputPos + PASTE_BEGIN.length();
+    std::string::size_type searched = begin;
+    std::string::size_type end;
+    while ((end = input.find(PASTE_END, searched)) == std::string::npos) {
+        // Only new data needs a look, minus what could be a partial marker
+        searched = std::max(begin, input.length() - std::min(input.length(), PASTE_END.length() - 1));
+        if (!waitInput(PASTE_TIMEOUT_MS)) {
+            end = input.length();
+            break;
+        }
+    }
+    text.assign(input, begin, end - begin);
+    inputPos = std::min(input.length(), end + PASTE_END.length());
+    if (inputPos == input.length()) {
+        input.clear();
+        inputPos = 0;
+    }
+    return true;
+}
+
+bool Terminal::inputPending()
+{
+    return inputPos < input.length() || waitInput(0);
 }
 
 void Terminal::setInputFlags()
@@ -78,14 +213,20 @@ void Terminal::setLocalFlags()
 
 void Terminal::setTimeout()
 {
+    // Reads return at once, waiting for input is done with poll
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 }
 
 void Terminal::disableRawMode() {
     if (!enabled) return;
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios) == -1) Terminal::get()->die("Can't restore terminal settings");
+    ssize_t res = write(STDOUT_FILENO, CMD_PASTE_OFF.data(), CMD_PASTE_OFF.length());
+    (void)res;
     enabled = false;
+    // A terminal that hung up has no settings left to restore
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios) == -1 && !Terminal::get()->closed()) {
+        Terminal::get()->die("Can't restore terminal settings");
+    }
 }
 
 void Terminal::die(std::string s) {
@@ -118,6 +259,8 @@ void Terminal::clearScreen()
 {
     append(CMD_CLEAR_SCREEN);
     cursorTopLeft();
+    // Whatever was on screen has to be drawn again
+    screen.clear();
 }
 
 void Terminal::cursorTopLeft()
@@ -151,6 +294,13 @@ void Terminal::getWindowSize()
     height = ws.ws_row;
 }
 
+void Terminal::resize()
+{
+    getWindowSize();
+    // Whatever was on screen has to be drawn again
+    screen.clear();
+}
+
 void Terminal::flush()
 {
     flushBuffer();
@@ -158,73 +308,249 @@ void Terminal::flush()
 
 void Terminal::flushBuffer()
 {
-    write(STDOUT_FILENO, buffer.c_str(), buffer.length());
+    output(buffer);
 }
 
-std::string Terminal::renderLines(const std::vector<std::string> &lines) const
+void Terminal::output(const std::string &s)
 {
-    std::string res = CMD_CURSOR_TOPLEFT;
-    size_t target = lines.size();
-    for (size_t i = 0; i < target; ++i) {
-        res += lines[i];
-        res += CMD_REMOVE_TILL_END;
-        if (i < target - 1) res += NEWLINE;
+    const char *p = s.data();
+    size_t left = s.length();
+    while (left > 0) {
+        ssize_t res = write(STDOUT_FILENO, p, left);
+        if (res < 0 && errno == EINTR) continue;
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Non-blocking output, waits until the terminal takes more
+            struct pollfd pfd = { STDOUT_FILENO, POLLOUT, 0 };
+            if (poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+        }
+        if (res <= 0) break;
+        p += res;
+        left -= res;
     }
-    res += CMD_CURSOR_SHOW;
-    return res;
+    bytesOut += s.length() - left;
 }
 
-void Terminal::flushData()
+// Columns putText() fills with text
+static int textColumns(std::string_view text)
 {
-    editor::Buffer::getCurrent()->relocateRow(width, height - reservedLinesBottom);
-    std::string bf = renderLines(editor::Buffer::getCurrent()->viewport(width, height - reservedLinesBottom));
-    bf += cursorPos(editor::Buffer::getCurrent()->x() + 1, editor::Buffer::getCurrent()->y(height - reservedLinesBottom) + 1);
-    write(STDOUT_FILENO, bf.c_str(), bf.length());
+    const char *p = text.data();
+    const char *end = p + text.length();
+    int cols = 0;
+    while (p < end) {
+        uint32_t c = editor::utf8_decode(p, end);
+        int w = c == UINT32_MAX ? -1 : editor::charWidth(c);
+        cols += w < 0 || (w == 0 && cols == 0) ? 1 : w;
+    }
+    return cols;
+}
+
+void Terminal::putText(Row &cells, int col, std::string_view text)
+{
+    const char *p = text.data();
+    const char *end = p + text.length();
+    // Lines of a \r\n file keep their \r, it takes no room
+    if (p < end && end[-1] == '\r') --end;
+    // Cell of the previous character, combining marks go there
+    int prev = -1;
+    while (p < end) {
+        const char *start = p;
+        uint32_t c = editor::utf8_decode(p, end);
+        int w = c == UINT32_MAX ? -1 : editor::charWidth(c);
+        if (w == 0) {
+            if (prev < 0) {
+                // Nothing to combine with, shown on a space instead
+                if (col >= width) break;
+                cells[col] = ' ';
+                prev = col++;
+            }
+            std::string bytes;
+            appendCell(bytes, cells[prev]);
+            cells[prev] = packCell(bytes.append(start, p - start));
+            continue;
+        }
+        if (col >= width) break;
+        if (w == 2 && col + 1 == width) {
+            // Half a wide character can not be shown
+            cells[col] = ' ';
+            break;
+        }
+        prev = col;
+        cells[col++] = w < 0 ? '?' : packCell(std::string_view(start, p - start));
+        if (w == 2) cells[col++] = 0;
+    }
 }
 
-void Terminal::flushTemp()
+uint32_t Terminal::packCell(std::string_view bytes)
 {
-    if (temp.empty()) return;
-    std::string temp2 = temp  + CMD_REMOVE_TILL_END;
-    write(STDOUT_FILENO, temp2.c_str(), temp2.length());
+    if (bytes.length() <= 4) {
+        uint32_t cell = 0;
+        for (size_t i = 0; i < bytes.length(); ++i) cell |= static_cast<uint32_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+        return cell;
+    }
+    std::unordered_map<std::string, uint32_t>::iterator it = clusterIds.find(std::string(bytes));
+    if (it != clusterIds.end()) return it->second;
+    uint32_t cell = 0xFF000000 | clusters.size();
+    clusters.emplace_back(bytes);
+    clusterIds.emplace(bytes, cell);
+    return cell;
 }
 
-void Terminal::flushStatus()
+void Terminal::appendCell(std::string &out, uint32_t cell) const
 {
-    if (statusTime == 0) return;
-    std::string statusData = cursorLastRow() + status + CMD_REMOVE_TILL_END;
-    write(STDOUT_FILENO, statusData.c_str(), statusData.length());
-    if (statusTime > 0) --statusTime;
-    if (statusTime == 0) status = "";
+    // 0xFF never shows up in UTF-8
+    if ((cell >> 24) == 0xFF) out += clusters[cell & 0xFFFFFF];
+    else for (; cell != 0; cell >>= 8) out += static_cast<char>(cell & 0xFF);
 }
 
-void Terminal::flushInfo()
+std::string Terminal::infoText() const
 {
     std::string info;
     info += std::to_string(editor::Buffer::getCurrent()->x() + 1);
     info += ",";
     info += std::to_string(editor::Buffer::getCurrent()->y() + 1);
     info += " ";
-    uint32_t cnt = editor::Buffer::getCurrent()->size();
-    if (cnt == 0) info += "0";
-    else info += std::to_string((editor::Buffer::getCurrent()->y() + 1) * 100 / cnt);
-    info += "%";
-    info = cursorPos(width - info.length(), height - 1) + info;
-    write(STDOUT_FILENO, info.c_str(), info.length());
+    if (editor::Buffer::getCurrent()->following()) info += "[follow] ";
+    // Counting lines of a lazily indexed file would scan all of it
+    uint32_t loaded = editor::Buffer::getCurrent()->loadPercent();
+    if (editor::Buffer::getCurrent()->loading()) {
+        info += std::to_string(loaded) + "% loaded";
+    } else if (!editor::Buffer::getCurrent()->sizeKnown()) {
+        info += "--%";
+    } else {
+        uint32_t cnt = editor::Buffer::getCurrent()->size();
+        if (cnt == 0) info += "0";
+        else info += std::to_string((editor::Buffer::getCurrent()->y() + 1) * 100 / cnt);
+        info += "%";
+    }
+    return info;
 }
 
+void Terminal::composeFrame()
+{
+    if (clusters.size() > MAX_CLUSTERS) {
+        // The screen refers to the old ones, so it is drawn again
+        clusters.clear();
+        clusterIds.clear();
+        screen.clear();
+    }
+    frame.assign(height, Row(width, ' '));
+    int rows = height - reservedLinesBottom;
+
+    editor::Buffer *buf = editor::Buffer::getCurrent();
+    buf->relocateRow(width, rows);
+    std::string line;
+    for (int i = 0; i < rows; ++i) {
+        line.clear();
+        buf->renderLine(buf->topRow() + i, line, width);
+        putText(frame[i], 0, line);
+    }
 
-int Terminal::getHeight() const
+    // Command line, then status on top of it; the last one shown stays
+    if (!temp.empty()) bottom = commandText();
+    if (statusTime > 0) {
+        bottom = status;
+        if (--statusTime == 0) status = "";
+    }
+    putText(frame[height - 1], 0, bottom);
+
+    std::string info = infoText();
+    if (height >= 2) putText(frame[height - 2], std::max<int>(0, width - static_cast<int>(info.length()) - 1), info);
+}
+
+std::string_view Terminal::commandText() const
 {
-    return height - reservedLinesBottom - 1;
+    // Command line starts with a move to the last row
+    std::string_view t = temp;
+    if (!t.empty() && t[0] == ESCAPE_KEY[0]) {
+        std::string_view::size_type h = t.find('H');
+        t.remove_prefix(h == std::string_view::npos ? t.length() : h + 1);
+    }
+    return t;
 }
 
-void Terminal::relocateCursor()
+void Terminal::moveCursor(std::string &out, int x, int y)
 {
-    if (!temp.empty()) return;
-    uint32_t tabs = editor::Buffer::getCurrent()->tabExtra();
-    std::string pos = cursorPos(editor::Buffer::getCurrent()->x() + tabs + 1, editor::Buffer::getCurrent()->y(height - reservedLinesBottom) + 1);
-    write(STDOUT_FILENO, pos.c_str(), pos.length());
+    if (cursorY == y && cursorX == x) return;
+    if (cursorY == y && x == 1) out += '\r';
+    else if (cursorY + 1 == y && cursorY > 0 && x == 1) out += NEWLINE;
+    else if (cursorY == y && cursorX > 0 && x > cursorX) out += ESCAPE_KEY "[" + std::to_string(x - cursorX) + "C";
+    else out += cursorPos(x, y);
+    cursorX = x;
+    cursorY = y;
+}
+
+void Terminal::scrollText(std::string &out, int delta)
+{
+    // Only pays off when the rows that stay match once moved
+    int rows = height - reservedLinesBottom;
+    int kept = 0;
+    int unmoved = 0;
+    for (int y = 0; y < rows; ++y) {
+        int from = y + delta;
+        if (from >= 0 && from < rows && frame[y] == screen[from]) ++kept;
+        if (frame[y] == screen[y]) ++unmoved;
+    }
+    if (kept <= unmoved) return;
+
+    // Setting the region homes the cursor
+    out += ESCAPE_KEY "[1;" + std::to_string(rows) + "r";
+    out += ESCAPE_KEY "[" + std::to_string(std::abs(delta)) + (delta > 0 ? "S" : "T");
+    out += CMD_RESET_SCROLL_REGION;
+    cursorX = 1;
+    cursorY = 1;
+
+    if (delta > 0) std::rotate(screen.begin(), screen.begin() + delta, screen.begin() + rows);
+    else std::rotate(screen.begin(), screen.begin() + rows + delta, screen.begin() + rows);
+    int exposed = delta > 0 ? rows - delta : 0;
+    for (int y = exposed; y < exposed + std::abs(delta); ++y) screen[y].assign(width, ' ');
+}
+
+void Terminal::drawFrame(std::string &out)
+{
+    const editor::Buffer *buf = editor::Buffer::getCurrent();
+    int64_t delta = static_cast<int64_t>(buf->topRow()) - screenRow;
+    int rows = height - reservedLinesBottom;
+
+    if (screen.size() != frame.size() || screen[0].size() != frame[0].size()) {
+        out += CMD_CLEAR_SCREEN;
+        screen.assign(height, Row(width, ' '));
+        cursorX = -1;
+        cursorY = -1;
+    } else if (buf == screenBuffer && delta != 0 && std::abs(delta) < rows) {
+        scrollText(out, delta);
+    }
+    screenBuffer = buf;
+    screenRow = buf->topRow();
+
+    for (int y = 0; y < height; ++y) {
+        const Row &now = frame[y];
+        const Row &old = screen[y];
+        int first = 0;
+        while (first < width && now[first] == old[first]) ++first;
+        if (first == width) continue;
+        int last = width - 1;
+        while (now[last] == old[last]) --last;
+        // Wide characters are written whole
+        while (first > 0 && now[first] == 0) --first;
+        while (last + 1 < width && now[last + 1] == 0) ++last;
+        // A blank tail is cheaper to erase than to write
+        int used = width;
+        while (used > first && now[used - 1] == ' ') --used;
+        bool erase = last >= used;
+        int stop = erase ? used : last + 1;
+
+        moveCursor(out, first + 1, y + 1);
+        for (int x = first; x < stop; ++x) appendCell(out, now[x]);
+        if (erase) out += CMD_REMOVE_TILL_END;
+        // Past the last column the terminal may be waiting to wrap
+        cursorX = stop < width ? stop + 1 : -1;
+    }
+    screen.swap(frame);
+}
+
+int Terminal::getHeight() const
+{
+    return height - reservedLinesBottom - 1;
 }
 
 void Terminal::appendTemp(std::string s)
@@ -254,17 +580,31 @@ void Terminal::resetTemp()
 
 void Terminal::refresh()
 {
-    buffer = "";
-    append(CMD_CURSOR_HIDE);
-    flushBuffer();
-    cursorTopLeft();
-    flushData();
-    flushTemp();
-    flushStatus();
-    flushInfo();
+    composeFrame();
+    // The whole frame goes out in one write, reusing the buffer
+    out.clear();
+    if (syncOutput) out += CMD_SYNC_BEGIN;
+    out += CMD_CURSOR_HIDE;
+    size_t header = out.length();
+    drawFrame(out);
+    bool drawn = out.length() > header;
+
+    int rows = height - reservedLinesBottom;
+    if (temp.empty()) {
+        int x = editor::Buffer::getCurrent()->screenX(width) + 1;
+        moveCursor(out, std::min(x, width), editor::Buffer::getCurrent()->y(rows) + 1);
+    } else {
+        int x = textColumns(commandText()) + 1;
+        moveCursor(out, std::min(x, width), height);
+    }
 
-    buffer = "";
-    append(CMD_CURSOR_SHOW);
-    flushBuffer();
-    relocateCursor();
+    if (drawn) {
+        out += CMD_CURSOR_SHOW;
+        if (syncOutput) out += CMD_SYNC_END;
+    } else {
+        // At most a cursor move, nothing to hide or synchronize
+        out.erase(0, header);
+    }
+    output(out);
+    ++refreshes;
 }
@@ -1,43 +1,215 @@
 #include "tools.hh"
-#include "utf8.h"
 #include "terminal.hh"
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <fstream>
+#include <new>
+#include <thread>
+#include <vector>
+#include <wchar.h>
 
-std::string editor::substrSafe(std::string s, std::string::size_type p, std::string::size_type cnt)
+using editor::Utf8Index;
+
+static std::atomic<uint64_t> allocations(0);
+
+#ifdef MIV_COUNT_ALLOCATIONS
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) size = 1;
+    void *p = std::malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+static const uint32_t utf8IndexStep = 256;
+
+static bool isContinuation(char c)
+{
+    return (c & 0xC0) == 0x80;
+}
+
+// Byte offset cnt codepoints after from, or s.length() if the string ends first
+static std::string_view::size_type advanceChars(std::string_view s, std::string_view::size_type from, std::string_view::size_type cnt)
+{
+    std::string_view::size_type len = s.length();
+    while (cnt > 0 && from < len) {
+        ++from;
+        while (from < len && isContinuation(s[from])) ++from;
+        --cnt;
+    }
+    return from;
+}
+
+Utf8Index::Utf8Index() :
+    len(0),
+    isAscii(true)
+{
+}
+
+Utf8Index::Utf8Index(std::string_view s) :
+    Utf8Index()
+{
+    build(s);
+}
+
+void Utf8Index::build(std::string_view first, std::string_view second)
+{
+    len = 0;
+    isAscii = true;
+    marks.clear();
+
+    if (utf8_length(first.data(), first.data() + first.length()) == first.length() &&
+        utf8_length(second.data(), second.data() + second.length()) == second.length()) {
+        len = first.length() + second.length();
+        return;
+    }
+
+    isAscii = false;
+    std::string_view::size_type base = 0;
+    for (std::string_view s : { first, second }) {
+        std::string_view::size_type sl = s.length();
+        for (std::string_view::size_type i = 0; i < sl; ++i) {
+            if (isContinuation(s[i])) continue;
+            if (len % utf8IndexStep == 0) marks.push_back(Mark{len, base + i});
+            ++len;
+        }
+        base += sl;
+    }
+}
+
+std::string_view::size_type Utf8Index::offset(std::string_view s, uint32_t p) const
+{
+    return offset(s, std::string_view(), p);
+}
+
+std::string_view::size_type Utf8Index::offset(std::string_view first, std::string_view second, uint32_t p) const
+{
+    if (p >= len) return first.length() + second.length();
+    if (isAscii) return p;
+    const Mark &m = *(std::upper_bound(marks.begin(), marks.end(), p,
+        [](uint32_t v, const Mark &mark) { return v < mark.pos; }) - 1);
+
+    std::string_view::size_type from = m.offset;
+    uint32_t cnt = p - m.pos;
+    std::string_view::size_type fl = first.length();
+    if (from >= fl) return fl + advanceChars(second, from - fl, cnt);
+    while (cnt > 0 && from < fl) {
+        ++from;
+        while (from < fl && isContinuation(first[from])) ++from;
+        --cnt;
+    }
+    // The parts split between codepoints, the rest of the walk is in the second
+    return from < fl ? from : fl + advanceChars(second, 0, cnt);
+}
+
+std::vector<Utf8Index::Mark>::iterator Utf8Index::markAt(uint32_t pos)
+{
+    return std::lower_bound(marks.begin(), marks.end(), pos,
+        [](const Mark &mark, uint32_t v) { return mark.pos < v; });
+}
+
+void Utf8Index::insert(uint32_t pos, std::string_view::size_type offset, std::string_view text)
+{
+    uint32_t cnt = utf8_length(text.data(), text.data() + text.length());
+    if (cnt == 0) return;
+    if (isAscii && cnt == text.length()) {
+        len += cnt;
+        return;
+    }
+    if (isAscii) {
+        // Codepoints and bytes of the text so far are the same
+        for (uint32_t p = 0; p < len; p += utf8IndexStep) marks.push_back(Mark{p, p});
+        isAscii = false;
+    }
+
+    std::vector<Mark>::iterator it = markAt(pos);
+    for (std::vector<Mark>::iterator m = it; m != marks.end(); ++m) {
+        m->pos += cnt;
+        m->offset += text.length();
+    }
+    len += cnt;
+
+    // Marks are only added where the gap between them grew too wide,
+    // so typing one character at a time does not add one each time
+    uint32_t next = it == marks.end() ? len : it->pos;
+    if (it != marks.begin() && next - (it - 1)->pos <= 2 * utf8IndexStep) return;
+    added.clear();
+    added.push_back(Mark{pos, offset});
+    uint32_t p = 0;
+    for (std::string_view::size_type i = 0; i < text.length(); ++i) {
+        if (isContinuation(text[i])) continue;
+        if (p > 0 && p % utf8IndexStep == 0) added.push_back(Mark{pos + p, offset + i});
+        ++p;
+    }
+    if (pos + cnt < next) added.push_back(Mark{pos + cnt, offset + text.length()});
+    marks.insert(it, added.begin(), added.end());
+}
+
+void Utf8Index::erase(uint32_t pos, std::string_view::size_type offset, uint32_t cnt, std::string_view::size_type bytes)
 {
-    if (p >= utf8_length(s)) return "";
+    if (cnt == 0) return;
+    len -= cnt;
+    if (isAscii) return;
 
-    uint32_t strlen = utf8_length(s);
-    auto startpos = s.begin();
+    std::vector<Mark>::iterator it = marks.erase(markAt(pos), markAt(pos + cnt));
+    for (std::vector<Mark>::iterator m = it; m != marks.end(); ++m) {
+        m->pos -= cnt;
+        m->offset -= bytes;
+    }
+    uint32_t next = it == marks.end() ? len : it->pos;
+    if (pos < len && next != pos && (it == marks.begin() || next - (it - 1)->pos > 2 * utf8IndexStep)) {
+        marks.insert(it, Mark{pos, offset});
+    }
+}
 
-    if (strlen < p) return "";
-    utf8::advance(startpos, p, s.end());
+std::string_view editor::substrSafe(std::string_view s, std::string_view::size_type p, std::string_view::size_type cnt)
+{
+    std::string_view::size_type start = advanceChars(s, 0, p);
+    if (start >= s.length()) return "";
+    return s.substr(start, advanceChars(s, start, cnt) - start);
+}
+
+std::string_view editor::substrSafe(std::string_view s, const Utf8Index &idx, std::string_view::size_type p, std::string_view::size_type cnt)
+{
+    if (p >= idx.length()) return "";
+    std::string_view::size_type start = idx.offset(s, p);
+    if (cnt >= idx.length() - p) return s.substr(start);
+    return s.substr(start, idx.offset(s, p + cnt) - start);
+}
 
-    auto endpos = startpos;
-    if (p >= strlen) return "";
-    if (cnt >= strlen) cnt = strlen;
-    if (p + cnt > strlen) cnt = strlen - p;
-    utf8::advance(endpos, cnt, s.end());
+char editor::utf8_at(std::string_view s, uint32_t p)
+{
+    std::string_view::size_type pos = advanceChars(s, 0, p);
+    return pos < s.length() ? s[pos] : 0;
+}
 
-    return std::string(startpos, endpos);
+char editor::utf8_at(std::string_view s, const Utf8Index &idx, uint32_t p)
+{
+    if (p >= idx.length()) return 0;
+    return s[idx.offset(s, p)];
 }
 
-char editor::utf8_at(std::string s, uint32_t p)
+std::string_view editor::utf8_at_str(std::string_view s, uint32_t p)
 {
-    if (p >= utf8_length(s)) return 0;
-    auto startpos = s.begin();
-    utf8::advance(startpos, p, s.end());
-    return *startpos;
+    return substrSafe(s, p, 1);
 }
 
-std::string editor::utf8_at_str(std::string s, uint32_t p)
+std::string_view editor::utf8_at_str(std::string_view s, const Utf8Index &idx, uint32_t p)
 {
-    if (p >= utf8_length(s)) return "";
-    auto startpos = s.begin();
-    utf8::advance(startpos, p, s.end());
-    auto endpos = startpos;
-    utf8::advance(endpos, 1, s.end());
-    return std::string(startpos, endpos);
+    return substrSafe(s, idx, p, 1);
 }
 
 void editor::log(std::string prefix, std::string s)
@@ -47,14 +219,224 @@ void editor::log(std::string prefix, std::string s)
     fd.close();
 }
 
-bool editor::utf8_valid(std::string s)
+// Length of the valid UTF-8 sequence at p, or 0 when it is malformed
+static size_t utf8_sequence(const unsigned char *p, const unsigned char *end)
 {
-    return s.end() == utf8::find_invalid(s.begin(), s.end());
+    unsigned char c = p[0];
+    if (c < 0x80) return 1;
+
+    size_t len;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        // Overlong forms and UTF-16 surrogates
+        if (c == 0xE0) lo = 0xA0;
+        else if (c == 0xED) hi = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        // Overlong forms and codepoints above U+10FFFF
+        if (c == 0xF0) lo = 0x90;
+        else if (c == 0xF4) hi = 0x8F;
+    } else return 0;
+
+    if (static_cast<size_t>(end - p) < len) return 0;
+    if (p[1] < lo || p[1] > hi) return 0;
+    for (size_t i = 2; i < len; ++i) {
+        if ((p[i] & 0xC0) != 0x80) return 0;
+    }
+    return len;
 }
 
-uint32_t editor::utf8_length(std::string s)
+static const unsigned char *utf8_skip_invalid(const unsigned char *p, const unsigned char *end)
 {
-    auto res = utf8::distance(s.begin(), s.end());
-    uint32_t r2 = res;
+    while (p < end && *p >= 0x80) {
+        size_t len = utf8_sequence(p, end);
+        if (len == 0) return nullptr;
+        p += len;
+    }
+    return p;
+}
+
+static bool utf8_valid_scalar(const unsigned char *p, const unsigned char *end)
+{
+    while (p < end) {
+        if (*p < 0x80) {
+            ++p;
+            continue;
+        }
+        p = utf8_skip_invalid(p, end);
+        if (p == nullptr) return false;
+    }
+    return true;
+}
+
+// Counts bytes that start a codepoint, ie. all but 10xxxxxx
+static uint64_t utf8_count_scalar(const unsigned char *p, const unsigned char *end)
+{
+    uint64_t res = 0;
+    for (; p < end; ++p) res += (*p & 0xC0) != 0x80;
     return res;
 }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static bool utf8_valid_sse2(const unsigned char *p, const unsigned char *end)
+{
+    while (end - p >= 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        if (mask == 0) {
+            p += 16;
+            continue;
+        }
+        p = utf8_skip_invalid(p + __builtin_ctz(mask), end);
+        if (p == nullptr) return false;
+    }
+    return utf8_valid_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static bool utf8_valid_avx2(const unsigned char *p, const unsigned char *end)
+{
+    while (end - p >= 32) {
+        uint32_t mask = _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        if (mask == 0) {
+            p += 32;
+            continue;
+        }
+        p = utf8_skip_invalid(p + __builtin_ctz(mask), end);
+        if (p == nullptr) return false;
+    }
+    return utf8_valid_scalar(p, end);
+}
+
+__attribute__((target("sse2,popcnt")))
+static uint64_t utf8_count_sse2(const unsigned char *p, const unsigned char *end)
+{
+    uint64_t res = 0;
+    const __m128i limit = _mm_set1_epi8(-65);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        res += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, limit)));
+        p += 16;
+    }
+    return res + utf8_count_scalar(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t utf8_count_avx2(const unsigned char *p, const unsigned char *end)
+{
+    uint64_t res = 0;
+    const __m256i limit = _mm256_set1_epi8(-65);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        res += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, limit)));
+        p += 32;
+    }
+    return res + utf8_count_scalar(p, end);
+}
+#endif
+
+typedef bool (*Utf8ValidFunc)(const unsigned char *, const unsigned char *);
+typedef uint64_t (*Utf8CountFunc)(const unsigned char *, const unsigned char *);
+
+static Utf8ValidFunc utf8_valid_impl()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return utf8_valid_avx2;
+    if (__builtin_cpu_supports("sse2")) return utf8_valid_sse2;
+#endif
+    return utf8_valid_scalar;
+}
+
+static Utf8CountFunc utf8_count_impl()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) return utf8_count_avx2;
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) return utf8_count_sse2;
+#endif
+    return utf8_count_scalar;
+}
+
+bool editor::utf8_valid(std::string_view s)
+{
+    return utf8_valid(s.data(), s.data() + s.length());
+}
+
+bool editor::utf8_valid(const char *begin, const char *end)
+{
+    static const Utf8ValidFunc utf8_valid_kernel = utf8_valid_impl();
+    return utf8_valid_kernel(reinterpret_cast<const unsigned char*>(begin), reinterpret_cast<const unsigned char*>(end));
+}
+
+uint32_t editor::utf8_decode(const char *&p, const char *end)
+{
+    unsigned char b = *p++;
+    if (b < 0x80) return b;
+    uint32_t len = (b & 0xE0) == 0xC0 ? 2 : (b & 0xF0) == 0xE0 ? 3 : (b & 0xF8) == 0xF0 ? 4 : 0;
+    if (len == 0 || end - p < len - 1) return UINT32_MAX;
+    uint32_t c = b & (0x7F >> len);
+    for (uint32_t i = 1; i < len; ++i) {
+        if (!isContinuation(p[i - 1])) return UINT32_MAX;
+        c = (c << 6) | (p[i - 1] & 0x3F);
+    }
+    p += len - 1;
+    return c;
+}
+
+int editor::charWidth(uint32_t c)
+{
+    if (c < 0x80) return c >= 0x20 && c != 0x7F ? 1 : -1;
+    int w = wcwidth(static_cast<wchar_t>(c));
+    // Unassigned codepoints still take a cell on most terminals
+    if (w < 0) return c < 0xA0 ? -1 : 1;
+    return w;
+}
+
+uint32_t editor::utf8_length(std::string_view s)
+{
+    return utf8_length(s.data(), s.data() + s.length());
+}
+
+uint32_t editor::utf8_length(const char *begin, const char *end)
+{
+    static const Utf8CountFunc utf8_count_kernel = utf8_count_impl();
+    return utf8_count_kernel(reinterpret_cast<const unsigned char*>(begin), reinterpret_cast<const unsigned char*>(end));
+}
+
+uint32_t editor::workerCount()
+{
+    // Set to measure how loading scales with the number of cores
+    const char *env = getenv("MIV_THREADS");
+    if (env != nullptr && atoi(env) > 0) return atoi(env);
+    uint32_t res = std::thread::hardware_concurrency();
+    if (res == 0) res = 1;
+    return std::min<uint32_t>(res, 16);
+}
+
+void editor::parallel(uint32_t jobs, std::function<void(uint32_t)> fn)
+{
+    std::vector<std::thread> workers;
+    for (uint32_t j = 1; j < jobs; ++j) workers.push_back(std::thread(fn, j));
+    if (jobs > 0) fn(0);
+    for (std::thread &t : workers) t.join();
+}
+
+bool editor::countingAllocations()
+{
+#ifdef MIV_COUNT_ALLOCATIONS
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t editor::allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,64 @@
+#include "buffer.hh"
+#include "tools.hh"
+
+#include <cstdio>
+#include <string>
+
+using editor::Buffer;
+
+// Typing, backspace and delete on a long line allocate nothing once
+// the line being edited has grown to its size
+
+static bool check(const char *what, uint64_t before)
+{
+    uint64_t cnt = editor::allocationCount() - before;
+    if (cnt == 0) return true;
+    fprintf(stderr, "%s: %llu allocations\n", what, static_cast<unsigned long long>(cnt));
+    return false;
+}
+
+int main()
+{
+    if (!editor::countingAllocations()) {
+        fprintf(stderr, "built without count_allocations\n");
+        return 77;
+    }
+
+    Buffer b;
+    b.addLine("first line");
+    b.addLine(std::string(100000, 'a') + " long line ä 日本語");
+    b.addLine("last line");
+    b.gotoY(2);
+    b.cursorRight(50000);
+
+    // Warm up, grows the line being edited
+    for (int i = 0; i < 2000; ++i) b.append('x');
+    for (int i = 0; i < 2000; ++i) b.backspaceChars(1);
+
+    bool ok = true;
+    uint64_t before = editor::allocationCount();
+    for (int i = 0; i < 1000; ++i) b.append('y');
+    ok = check("append", before) && ok;
+
+    before = editor::allocationCount();
+    for (int i = 0; i < 500; ++i) b.backspaceChars(1);
+    ok = check("backspace", before) && ok;
+
+    b.cursorLeft(200);
+    before = editor::allocationCount();
+    for (int i = 0; i < 200; ++i) b.deleteChars(1);
+    ok = check("delete", before) && ok;
+
+    for (int i = 0; i < 1000; ++i) {
+        b.append('z');
+        b.backspaceChars(1);
+    }
+    before = editor::allocationCount();
+    for (int i = 0; i < 1000; ++i) {
+        b.append('z');
+        b.backspaceChars(1);
+    }
+    ok = check("append and backspace", before) && ok;
+
+    return ok ? 0 : 1;
+}